@@ -0,0 +1,278 @@
+#include "ChunkCache.h"
+
+ChunkCache::ChunkCache()
+{
+    arena = nullptr;
+    arena_size = 0;
+    num_slots = 0;
+    block_size = 0;
+    huge_pages = false;
+    slot_mutex = std::make_shared<std::mutex>();
+    free_slots = std::make_shared<std::vector<int>>();
+    next_ticket = 0;
+    stopping = false;
+    fill_thread_started = false;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+ChunkCache::~ChunkCache()
+{
+    if (fill_thread_started)
+    {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            stopping = true;
+        }
+        fill_available.notify_all();
+        pthread_join(fill_thread_id, nullptr);
+    }
+    fills.clear();
+    entries.clear();
+    lru.clear();
+    if (arena)
+        munmap(arena, arena_size);
+}
+
+bool ChunkCache::init(size_t budget_bytes, size_t block_size, bool huge_pages)
+{
+    size_t num_slots = block_size > 0 ? budget_bytes / block_size : 0;
+    if (num_slots == 0)
+        return false;
+    this->num_slots = num_slots;
+    arena_size = num_slots * block_size;
+    void *memory = MAP_FAILED;
+    if (huge_pages)
+    {
+        const size_t huge_page_size = 2 * 1024 * 1024;
+        size_t huge_size = (arena_size + huge_page_size - 1) / huge_page_size * huge_page_size;
+        memory = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+            arena_size = huge_size;
+    }
+    if (memory == MAP_FAILED)
+    {
+        huge_pages = false;
+        memory = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return false;
+    }
+    arena = static_cast<char *>(memory);
+    this->block_size = block_size;
+    this->huge_pages = huge_pages;
+    for (size_t i = 0; i < num_slots; i++)
+    {
+        free_slots->push_back(num_slots - 1 - i);
+    }
+    fill_thread_started = pthread_create(&fill_thread_id, nullptr, fill_thread_helper, this) == 0;
+    return true;
+}
+
+bool ChunkCache::enabled() const
+{
+    return arena != nullptr;
+}
+
+size_t ChunkCache::get_block_size() const
+{
+    return block_size;
+}
+
+// Never touches the disk, so it is safe on an event loop: a miss returns
+// null and the caller sends from the file instead. owner keeps fd open until
+// a fill queued by the miss has run.
+std::shared_ptr<ChunkBlock> ChunkCache::lookup(int file_id, int fd, long offset, long file_size, const std::shared_ptr<const void> &owner)
+{
+    BlockKey key(file_id, offset - offset % block_size);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        hits++;
+        return it->second.block;
+    }
+    misses++;
+    note_miss(key, fd, file_size, owner);
+    return nullptr;
+}
+
+// A block is only read in on its second miss, so a single pass over cold
+// data (one client streaming a whole file) cannot push out blocks that are
+// asked for repeatedly. Misses are remembered for about as many blocks as
+// the cache holds. Called with cache_mutex held.
+void ChunkCache::note_miss(const BlockKey &key, int fd, long file_size, const std::shared_ptr<const void> &owner)
+{
+    if (!fill_thread_started || filling.count(key))
+        return;
+    auto seen = seen_once.find(key);
+    if (seen == seen_once.end())
+    {
+        seen_order.push_back(key);
+        seen_once[key] = std::prev(seen_order.end());
+        if (seen_order.size() > num_slots)
+        {
+            seen_once.erase(seen_order.front());
+            seen_order.pop_front();
+        }
+        return;
+    }
+    seen_order.erase(seen->second);
+    seen_once.erase(seen);
+    if (fills.size() >= MAX_PENDING_FILLS)
+        return;
+    uint64_t ticket = ++next_ticket;
+    filling[key] = ticket;
+    fills.push_back({key, ticket, fd, file_size, owner});
+    fill_available.notify_one();
+}
+
+void *ChunkCache::fill_thread_helper(void *arg)
+{
+    return static_cast<ChunkCache *>(arg)->fill_thread();
+}
+
+// Reads admitted blocks into free (or evicted) slots. A fill whose file was
+// invalidated while it was reading is dropped rather than cached.
+void *ChunkCache::fill_thread()
+{
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    while (1)
+    {
+        fill_available.wait(lock, [&]
+                            { return stopping || !fills.empty(); });
+        if (stopping)
+            break;
+        FillRequest request = std::move(fills.front());
+        fills.pop_front();
+        int slot = take_slot();
+        if (slot < 0)
+        {
+            filling.erase(request.key);
+            continue;
+        }
+        std::shared_ptr<ChunkBlock> block = make_block(slot, request.key.first, request.key.second);
+        lock.unlock();
+
+        long wanted = std::min<long>(block_size, request.file_size - request.key.second);
+        long filled = 0;
+        while (filled < wanted)
+        {
+            ssize_t n = pread(request.fd, block->data + filled, wanted - filled, request.key.second + filled);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            filled += n;
+        }
+        block->length = filled;
+        request.owner.reset();
+
+        lock.lock();
+        auto pending = filling.find(request.key);
+        if (pending == filling.end() || pending->second != request.ticket)
+            continue;
+        filling.erase(pending);
+        if (filled == 0)
+            continue;
+        lru.push_front(request.key);
+        entries[request.key] = {block, lru.begin()};
+    }
+    return nullptr;
+}
+
+int ChunkCache::take_slot()
+{
+    while (1)
+    {
+        {
+            std::lock_guard<std::mutex> slot_lock(*slot_mutex);
+            if (!free_slots->empty())
+            {
+                int slot = free_slots->back();
+                free_slots->pop_back();
+                return slot;
+            }
+        }
+        auto victim = lru.end();
+        for (auto pos = lru.rbegin(); pos != lru.rend(); ++pos)
+        {
+            if (entries[*pos].block.use_count() == 1)
+            {
+                victim = std::next(pos).base();
+                break;
+            }
+        }
+        if (victim == lru.end())
+            return -1;
+        entries.erase(*victim);
+        lru.erase(victim);
+        evictions++;
+    }
+}
+
+std::shared_ptr<ChunkBlock> ChunkCache::make_block(int slot, int file_id, long offset)
+{
+    std::shared_ptr<std::mutex> mutex = slot_mutex;
+    std::shared_ptr<std::vector<int>> slots = free_slots;
+    ChunkBlock *block = new ChunkBlock{file_id, offset, 0, arena + slot * block_size};
+    return std::shared_ptr<ChunkBlock>(block, [mutex, slots, slot](ChunkBlock *b)
+                                       {
+                                           delete b;
+                                           std::lock_guard<std::mutex> lock(*mutex);
+                                           slots->push_back(slot);
+                                       });
+}
+
+void ChunkCache::invalidate(int file_id)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = entries.lower_bound(BlockKey(file_id, 0));
+    while (it != entries.end() && it->first.first == file_id)
+    {
+        lru.erase(it->second.lru_pos);
+        it = entries.erase(it);
+    }
+    forget_pending(file_id);
+}
+
+void ChunkCache::clear()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    entries.clear();
+    lru.clear();
+    seen_once.clear();
+    seen_order.clear();
+    filling.clear();
+    fills.clear();
+}
+
+// Drops remembered misses and queued or running fills for file_id; a fill
+// already reading finds its ticket gone and discards the block. Called with
+// cache_mutex held.
+void ChunkCache::forget_pending(int file_id)
+{
+    auto seen = seen_once.lower_bound(BlockKey(file_id, 0));
+    while (seen != seen_once.end() && seen->first.first == file_id)
+    {
+        seen_order.erase(seen->second);
+        seen = seen_once.erase(seen);
+    }
+    auto pending = filling.lower_bound(BlockKey(file_id, 0));
+    while (pending != filling.end() && pending->first.first == file_id)
+        pending = filling.erase(pending);
+    for (auto fill = fills.begin(); fill != fills.end();)
+    {
+        if (fill->key.first == file_id)
+            fill = fills.erase(fill);
+        else
+            ++fill;
+    }
+}
+
+ChunkCacheStats ChunkCache::get_stats()
+{
+    std::lock_guard<std::mutex> lock(*slot_mutex);
+    return {hits, misses, evictions, num_slots * block_size, (num_slots - free_slots->size()) * block_size, huge_pages};
+}
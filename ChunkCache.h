@@ -0,0 +1,97 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <utility>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+const size_t MAX_PENDING_FILLS = 64;
+
+struct ChunkBlock
+{
+    int file_id;
+    long offset;
+    long length;
+    char *data;
+};
+
+struct ChunkCacheStats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t budget_bytes;
+    size_t used_bytes;
+    bool huge_pages;
+};
+
+class ChunkCache
+{
+public:
+    ChunkCache();
+    ~ChunkCache();
+    bool init(size_t budget_bytes, size_t block_size, bool huge_pages);
+    bool enabled() const;
+    size_t get_block_size() const;
+    std::shared_ptr<ChunkBlock> lookup(int file_id, int fd, long offset, long file_size, const std::shared_ptr<const void> &owner);
+    void invalidate(int file_id);
+    void clear();
+    ChunkCacheStats get_stats();
+
+private:
+    typedef std::pair<int, long> BlockKey;
+    struct CacheEntry
+    {
+        std::shared_ptr<ChunkBlock> block;
+        std::list<BlockKey>::iterator lru_pos;
+    };
+    struct FillRequest
+    {
+        BlockKey key;
+        uint64_t ticket;
+        int fd;
+        long file_size;
+        std::shared_ptr<const void> owner;
+    };
+    char *arena;
+    size_t arena_size;
+    size_t num_slots;
+    size_t block_size;
+    bool huge_pages;
+    std::mutex cache_mutex;
+    std::shared_ptr<std::mutex> slot_mutex;
+    std::shared_ptr<std::vector<int>> free_slots;
+    std::map<BlockKey, CacheEntry> entries;
+    std::list<BlockKey> lru;
+    std::map<BlockKey, std::list<BlockKey>::iterator> seen_once;
+    std::list<BlockKey> seen_order;
+    std::map<BlockKey, uint64_t> filling;
+    std::deque<FillRequest> fills;
+    uint64_t next_ticket;
+    std::condition_variable fill_available;
+    bool stopping;
+    bool fill_thread_started;
+    pthread_t fill_thread_id;
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::atomic<unsigned long> evictions;
+    int take_slot();
+    std::shared_ptr<ChunkBlock> make_block(int slot, int file_id, long offset);
+    void note_miss(const BlockKey &key, int fd, long file_size, const std::shared_ptr<const void> &owner);
+    void forget_pending(int file_id);
+    static void *fill_thread_helper(void *arg);
+    void *fill_thread();
+};
+
+#endif
@@ -0,0 +1,369 @@
+#include "ChunkScheduler.h"
+
+// file_size bounds piece numbering for availability; missing_bytes, which
+// is less on a resumed download, is what has to arrive before finishing.
+ChunkScheduler::ChunkScheduler(uint64_t file_size, uint64_t missing_bytes, int num_peers)
+{
+    peers.resize(num_peers);
+    for (PeerQueue &queue : peers)
+    {
+        queue.queued_bytes = 0;
+        queue.alive = true;
+        queue.backing_off = false;
+        queue.available.complete = true;
+        queue.available.piece_size = 0;
+    }
+    this->file_size = file_size;
+    remaining_bytes = missing_bytes;
+    queued_bytes = 0;
+    live_peers = num_peers;
+    stopped = false;
+}
+
+void ChunkScheduler::assign(int peer, const ByteRange &range)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    if (range.length == 0)
+        return;
+    peers[peer].ranges.push_back(range);
+    peers[peer].queued_bytes += range.length;
+    queued_bytes += range.length;
+}
+
+bool ChunkScheduler::next_range(int peer, uint64_t max_size, ByteRange &range, bool wait)
+{
+    std::unique_lock<std::mutex> lock(scheduler_mutex);
+    while (1)
+    {
+        if (!peers[peer].alive || stopped)
+            return false;
+        if (take_local(peer, max_size, range) || (steal(peer) && take_local(peer, max_size, range)))
+        {
+            in_flight[range.offset] = {range.length, {peer}, std::chrono::steady_clock::now()};
+            return true;
+        }
+        if (hedge(peer, range))
+            return true;
+        if (!wait || remaining_bytes == 0)
+            return false;
+        work_available.wait_for(lock, std::chrono::milliseconds(20));
+    }
+}
+
+// Endgame: once nothing is queued and little remains, or a range has been in
+// flight far longer than usual, hand an in-flight range to another peer too.
+bool ChunkScheduler::hedge(int peer, ByteRange &range)
+{
+    if (queued_bytes > 0 || in_flight.empty())
+        return false;
+    bool endgame = remaining_bytes <= ENDGAME_THRESHOLD_BYTES;
+    double threshold = hedge_after_seconds();
+    if (!endgame && threshold <= 0.0)
+        return false;
+    auto now = std::chrono::steady_clock::now();
+    auto best = in_flight.end();
+    for (auto it = in_flight.begin(); it != in_flight.end(); ++it)
+    {
+        const InFlightRange &candidate = it->second;
+        if (candidate.holders.size() >= MAX_RANGE_COPIES ||
+            std::find(candidate.holders.begin(), candidate.holders.end(), peer) != candidate.holders.end() ||
+            !peers[peer].available.covers({it->first, candidate.length}))
+            continue;
+        if (!endgame && std::chrono::duration<double>(now - candidate.started).count() < threshold)
+            continue;
+        if (best == in_flight.end() || candidate.started < best->second.started)
+            best = it;
+    }
+    if (best == in_flight.end())
+        return false;
+    best->second.holders.push_back(peer);
+    range.offset = best->first;
+    range.length = best->second.length;
+    return true;
+}
+
+double ChunkScheduler::hedge_after_seconds()
+{
+    if (latencies.size() < 8)
+        return 0.0;
+    std::vector<double> sorted(latencies.begin(), latencies.end());
+    size_t index = sorted.size() * 95 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index] * HEDGE_LATENCY_FACTOR;
+}
+
+bool ChunkScheduler::take_local(int peer, uint64_t max_size, ByteRange &range)
+{
+    PeerQueue &queue = peers[peer];
+    if (queue.ranges.empty())
+        return false;
+    ByteRange &front = queue.ranges.front();
+    range.offset = front.offset;
+    range.length = std::min(max_size, front.length);
+    front.offset += range.length;
+    front.length -= range.length;
+    if (front.length == 0)
+        queue.ranges.pop_front();
+    queue.queued_bytes -= range.length;
+    queued_bytes -= range.length;
+    return true;
+}
+
+// Ranges left by failed or backing-off peers are taken whole; working peers
+// give up the back half of their last range, as long as that leaves both
+// sides a useful size. Only ranges the thief's seeder holds are considered.
+bool ChunkScheduler::steal(int peer)
+{
+    int victim = -1;
+    int victim_index = -1;
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        if (i == (size_t)peer)
+            continue;
+        int index = held_from_back(peer, peers[i]);
+        if (index < 0)
+            continue;
+        if (!peers[i].alive || peers[i].backing_off)
+        {
+            victim = i;
+            victim_index = index;
+            break;
+        }
+        if (victim < 0 || peers[i].queued_bytes > peers[victim].queued_bytes)
+        {
+            victim = i;
+            victim_index = index;
+        }
+    }
+    if (victim < 0)
+        return false;
+    PeerQueue &from = peers[victim];
+    PeerQueue &to = peers[peer];
+    auto held = from.ranges.begin() + victim_index;
+    ByteRange stolen = *held;
+    if (from.alive && !from.backing_off && stolen.length >= 2 * MIN_STEAL_SIZE)
+    {
+        uint64_t keep = stolen.length / 2;
+        held->length = keep;
+        stolen.offset += keep;
+        stolen.length -= keep;
+    }
+    else
+    {
+        if (from.alive && !from.backing_off && from.ranges.size() < 2)
+            return false;
+        from.ranges.erase(held);
+    }
+    from.queued_bytes -= stolen.length;
+    to.ranges.push_back(stolen);
+    to.queued_bytes += stolen.length;
+    return true;
+}
+
+// Index of the last range in from's queue that peer can fetch, or -1.
+int ChunkScheduler::held_from_back(int peer, const PeerQueue &from)
+{
+    for (int i = (int)from.ranges.size() - 1; i >= 0; i--)
+    {
+        if (peers[peer].available.covers(from.ranges[i]))
+            return i;
+    }
+    return -1;
+}
+
+// Returns false when another peer already delivered this range.
+bool ChunkScheduler::complete(int peer, const ByteRange &range, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    auto it = in_flight.find(range.offset);
+    if (it == in_flight.end() || it->second.length != range.length)
+        return false;
+    latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - it->second.started).count());
+    if (latencies.size() > LATENCY_SAMPLES)
+        latencies.pop_front();
+    for (int holder : it->second.holders)
+    {
+        if (holder != peer)
+            peers[holder].cancellations.push_back(range);
+    }
+    in_flight.erase(it);
+    remaining_bytes -= std::min(bytes, remaining_bytes);
+    if (remaining_bytes == 0)
+        work_available.notify_all();
+    return true;
+}
+
+std::vector<ByteRange> ChunkScheduler::take_cancellations(int peer)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    std::vector<ByteRange> cancellations;
+    cancellations.swap(peers[peer].cancellations);
+    return cancellations;
+}
+
+void ChunkScheduler::requeue(int peer, const ByteRange &range)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    if (range.length == 0)
+        return;
+    peers[peer].ranges.push_front(range);
+    peers[peer].queued_bytes += range.length;
+    queued_bytes += range.length;
+    work_available.notify_all();
+}
+
+void ChunkScheduler::peer_failed(int peer, const std::vector<ByteRange> &unfinished)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    PeerQueue &queue = peers[peer];
+    return_unfinished(peer, unfinished);
+    if (queue.alive)
+    {
+        queue.alive = false;
+        live_peers--;
+    }
+    work_available.notify_all();
+}
+
+// A peer that will retry after a backoff: its unfinished and queued ranges
+// stay with it but can be stolen whole by healthy peers in the meantime.
+void ChunkScheduler::suspend_peer(int peer, const std::vector<ByteRange> &unfinished)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    return_unfinished(peer, unfinished);
+    peers[peer].backing_off = true;
+    work_available.notify_all();
+}
+
+void ChunkScheduler::resume_peer(int peer)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    peers[peer].backing_off = false;
+}
+
+void ChunkScheduler::set_availability(int peer, const PieceAvailability &available)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    peers[peer].available = available;
+}
+
+// Whether anything still outstanding, queued or worth hedging, is held by
+// this peer's seeder; a peer that cannot help any more should stop waiting.
+bool ChunkScheduler::can_help(int peer)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    const PieceAvailability &available = peers[peer].available;
+    if (!peers[peer].alive || stopped || remaining_bytes == 0)
+        return false;
+    for (const PeerQueue &queue : peers)
+    {
+        for (const ByteRange &range : queue.ranges)
+        {
+            if (available.covers(range))
+                return true;
+        }
+    }
+    for (const auto &entry : in_flight)
+    {
+        if (available.covers({entry.first, entry.second.length}))
+            return true;
+    }
+    return false;
+}
+
+// The seeder turned down a range it was thought to hold. A range spanning
+// several pieces goes back to the same peer split at piece boundaries, so
+// the next refusal names a single missing piece. That piece is forgotten
+// for this peer and, unless another copy was delivered or is still in
+// flight, handed to the least loaded live peer that does hold it. With no
+// such peer the bytes stay outstanding and the download cannot finish from
+// this swarm.
+void ChunkScheduler::unavailable(int peer, const ByteRange &range)
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    auto it = in_flight.find(range.offset);
+    if (it == in_flight.end() || it->second.length != range.length)
+        return;
+    std::vector<int> &holders = it->second.holders;
+    holders.erase(std::remove(holders.begin(), holders.end(), peer), holders.end());
+    if (!holders.empty())
+        return;
+    in_flight.erase(it);
+    uint64_t piece_size = peers[peer].available.piece_size;
+    int target = -1;
+    if (piece_size > 0 && range.offset / piece_size != (range.offset + range.length - 1) / piece_size)
+    {
+        target = peer;
+        std::vector<ByteRange> pieces;
+        for (uint64_t offset = range.offset; offset < range.offset + range.length;)
+        {
+            uint64_t end = std::min(range.offset + range.length, (offset / piece_size + 1) * piece_size);
+            pieces.push_back({offset, end - offset});
+            offset = end;
+        }
+        for (auto piece = pieces.rbegin(); piece != pieces.rend(); ++piece)
+            peers[peer].ranges.push_front(*piece);
+    }
+    else
+    {
+        peers[peer].available.remove(range, file_size);
+        for (size_t i = 0; i < peers.size(); i++)
+        {
+            if (i == (size_t)peer || !peers[i].alive || !peers[i].available.covers(range))
+                continue;
+            if (target < 0 || peers[i].queued_bytes < peers[target].queued_bytes)
+                target = i;
+        }
+        if (target < 0)
+            return;
+        peers[target].ranges.push_back(range);
+    }
+    peers[target].queued_bytes += range.length;
+    queued_bytes += range.length;
+    work_available.notify_all();
+}
+
+// A range no longer in flight was already delivered by another peer (a
+// hedge loser can fail before its cancel is answered); queueing it again
+// would count its bytes twice.
+void ChunkScheduler::return_unfinished(int peer, const std::vector<ByteRange> &unfinished)
+{
+    PeerQueue &queue = peers[peer];
+    for (const ByteRange &range : unfinished)
+    {
+        if (range.length == 0)
+            continue;
+        auto it = in_flight.find(range.offset);
+        if (it == in_flight.end() || it->second.length != range.length)
+            continue;
+        std::vector<int> &holders = it->second.holders;
+        holders.erase(std::remove(holders.begin(), holders.end(), peer), holders.end());
+        if (!holders.empty())
+            continue;
+        in_flight.erase(it);
+        queue.ranges.push_back(range);
+        queue.queued_bytes += range.length;
+        queued_bytes += range.length;
+    }
+}
+
+bool ChunkScheduler::finished()
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    return remaining_bytes == 0 || live_peers == 0;
+}
+
+uint64_t ChunkScheduler::remaining()
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    return remaining_bytes;
+}
+
+// Hands out no more work, waking any worker parked in next_range, so a
+// paused or cancelled download winds down without waiting for stragglers.
+void ChunkScheduler::stop()
+{
+    std::lock_guard<std::mutex> lock(scheduler_mutex);
+    stopped = true;
+    work_available.notify_all();
+}
@@ -0,0 +1,73 @@
+#ifndef CHUNK_SCHEDULER_H
+#define CHUNK_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include "Protocol.h"
+
+const uint64_t MIN_STEAL_SIZE = 64 * 1024;
+const uint64_t ENDGAME_THRESHOLD_BYTES = 2 * 1024 * 1024;
+const size_t MAX_RANGE_COPIES = 2;
+const double HEDGE_LATENCY_FACTOR = 2.0;
+const size_t LATENCY_SAMPLES = 64;
+
+class ChunkScheduler
+{
+public:
+    ChunkScheduler(uint64_t file_size, uint64_t missing_bytes, int num_peers);
+    void assign(int peer, const ByteRange &range);
+    bool next_range(int peer, uint64_t max_size, ByteRange &range, bool wait);
+    bool complete(int peer, const ByteRange &range, uint64_t bytes);
+    std::vector<ByteRange> take_cancellations(int peer);
+    void requeue(int peer, const ByteRange &range);
+    void peer_failed(int peer, const std::vector<ByteRange> &unfinished);
+    void suspend_peer(int peer, const std::vector<ByteRange> &unfinished);
+    void resume_peer(int peer);
+    void set_availability(int peer, const PieceAvailability &available);
+    bool can_help(int peer);
+    void unavailable(int peer, const ByteRange &range);
+    bool finished();
+    uint64_t remaining();
+    void stop();
+
+private:
+    struct PeerQueue
+    {
+        std::deque<ByteRange> ranges;
+        uint64_t queued_bytes;
+        bool alive;
+        bool backing_off;
+        PieceAvailability available;
+        std::vector<ByteRange> cancellations;
+    };
+    struct InFlightRange
+    {
+        uint64_t length;
+        std::vector<int> holders;
+        std::chrono::steady_clock::time_point started;
+    };
+    std::mutex scheduler_mutex;
+    std::condition_variable work_available;
+    std::vector<PeerQueue> peers;
+    uint64_t file_size;
+    uint64_t remaining_bytes;
+    uint64_t queued_bytes;
+    int live_peers;
+    bool stopped;
+    std::map<uint64_t, InFlightRange> in_flight;
+    std::deque<double> latencies;
+    bool take_local(int peer, uint64_t max_size, ByteRange &range);
+    bool steal(int peer);
+    int held_from_back(int peer, const PeerQueue &from);
+    bool hedge(int peer, ByteRange &range);
+    void return_unfinished(int peer, const std::vector<ByteRange> &unfinished);
+    double hedge_after_seconds();
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "ChunkSizePolicy.h"
+
+ChunkSizePolicy::ChunkSizePolicy(long min_size, long max_size, long initial_size)
+{
+    this->min_size = min_size;
+    this->max_size = std::max(min_size, max_size);
+    chunk_size = std::min(std::max(initial_size, this->min_size), this->max_size);
+    throughput = 0.0;
+    rtt = 0.0;
+}
+
+long ChunkSizePolicy::get_chunk_size() const
+{
+    return chunk_size;
+}
+
+void ChunkSizePolicy::record_rtt(double seconds)
+{
+    if (seconds <= 0.0)
+        return;
+    rtt = rtt == 0.0 ? seconds : std::min(seconds, 0.875 * rtt + 0.125 * seconds);
+}
+
+// bytes delivered over seconds of wall time; grow or shrink the chunk (at most
+// 2x per step) towards TARGET_CHUNK_SECONDS worth of data, and never below
+// what one round trip can carry.
+void ChunkSizePolicy::record_transfer(long bytes, double seconds)
+{
+    if (bytes <= 0 || seconds <= 0.0)
+        return;
+    double sample = bytes / seconds;
+    throughput = throughput == 0.0 ? sample : 0.75 * throughput + 0.25 * sample;
+    double desired = throughput * std::max(TARGET_CHUNK_SECONDS, rtt);
+    long next = chunk_size;
+    if (desired > chunk_size * 1.5)
+        next = chunk_size * 2;
+    else if (desired < chunk_size / 1.5)
+        next = chunk_size / 2;
+    chunk_size = std::min(std::max(next, min_size), max_size);
+}
@@ -0,0 +1,26 @@
+#ifndef CHUNK_SIZE_POLICY_H
+#define CHUNK_SIZE_POLICY_H
+
+#include <algorithm>
+
+const long MIN_CHUNK_SIZE = 64 * 1024;
+const long DEFAULT_CHUNK_SIZE = 256 * 1024;
+const double TARGET_CHUNK_SECONDS = 0.05;
+
+class ChunkSizePolicy
+{
+public:
+    ChunkSizePolicy(long min_size, long max_size, long initial_size);
+    long get_chunk_size() const;
+    void record_rtt(double seconds);
+    void record_transfer(long bytes, double seconds);
+
+private:
+    long min_size;
+    long max_size;
+    long chunk_size;
+    double throughput;
+    double rtt;
+};
+
+#endif
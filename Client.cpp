@@ -1,10 +1,62 @@
 #include "Client.h"
 
-Client::Client(const std::vector<int> &ports, int listen_port, const std::string &directory_path)
+// Starts writeback of the dirty mapping every MMAP_WRITEBACK_BYTES so the
+// kernel flushes the sequential fill as it goes instead of in one burst at
+// munmap time. msync(MS_ASYNC) is a no-op on Linux, hence sync_file_range.
+// Called on the event loop, so both it and the journal flush are handed to
+// the sync thread, which keeps the mapping alive until they have run.
+void MappedFile::wrote(uint64_t offset, size_t bytes)
+{
+    if (journal && journal->record(offset, bytes))
+    {
+        std::shared_ptr<MappedFile> self = shared_from_this();
+        sync->post(journal.get(), [self]
+                   { self->journal->flush(); });
+    }
+    if (unflushed.fetch_add(bytes) + bytes < MMAP_WRITEBACK_BYTES)
+        return;
+    unflushed = 0;
+    std::shared_ptr<MappedFile> self = shared_from_this();
+    sync->post(this, [self]
+               { sync_file_range(self->fd, 0, 0, SYNC_FILE_RANGE_WRITE); });
+}
+
+MappedFile::~MappedFile()
+{
+    if (journal)
+        journal->finish();
+    munmap(data, size);
+    close(fd);
+}
+
+Client::Client(const std::vector<int> &ports, int listen_port, const std::string &directory_path, int pipeline_depth)
+    : connection_pool(4, 30.0), peer_scores(directory_path + "/" + PEER_SCORES_FILE), download_manager(this, MAX_ACTIVE_WORKERS, MAX_WORKERS_PER_PEER)
 {
     this->ports = ports;
     this->listen_port = listen_port;
     this->directory_path = directory_path;
+    this->pipeline_depth = std::max(1, pipeline_depth);
+    receive_mode = RECEIVE_MODE_WRITE;
+    if (!download_loop.init())
+        perror("Failed to create download engine");
+    pthread_create(&download_loop_thread_id, nullptr, download_loop_helper, this);
+    download_manager.start();
+}
+
+// Stops the dispatcher and the engine before their members go away;
+// transfers still suspended at exit are abandoned and resume from their
+// journals next time.
+Client::~Client()
+{
+    download_manager.stop();
+    download_loop.stop();
+    pthread_join(download_loop_thread_id, nullptr);
+    sync_thread.stop();
+}
+
+void Client::set_receive_mode(ReceiveMode mode)
+{
+    receive_mode = mode;
 }
 
 void Client::run()
@@ -33,8 +85,21 @@ void Client::run()
             show_download_status();
         }
         else if (choice == 4)
+        {
+            pause_download();
+        }
+        else if (choice == 5)
+        {
+            resume_download();
+        }
+        else if (choice == 6)
+        {
+            cancel_download();
+        }
+        else if (choice == 7)
         {
             std::cout << "Exiting...\n";
+            peer_scores.save(true);
             break;
         }
         else
@@ -50,29 +115,91 @@ void Client::print_menu()
     std::cout << "[1] List available files.\n";
     std::cout << "[2] Download file.\n";
     std::cout << "[3] Download status.\n";
-    std::cout << "[4] Exit.\n";
+    std::cout << "[4] Pause download.\n";
+    std::cout << "[5] Resume download.\n";
+    std::cout << "[6] Cancel download.\n";
+    std::cout << "[7] Exit.\n";
     std::cout << "\n? ";
 }
 
+// Doubles as a probe for the scoreboard: the LIST round trip is the peer's
+// RTT sample and the response may carry its advertised upload capacity.
+bool Client::fetch_catalog(int port, std::map<int, FileInfo> &catalog)
+{
+    PeerConnection *conn = connection_pool.acquire(port);
+    if (!conn)
+    {
+        peer_scores.record_failure(port);
+        return false;
+    }
+    Frame frame;
+    uint32_t request_id = conn->next_request_id++;
+    auto sent_at = std::chrono::steady_clock::now();
+    bool ok = send_all(conn->fd, encode_frame(make_header(OP_LIST, request_id))) &&
+              read_frame(conn->fd, conn->decoder, frame) && frame.header.opcode == OP_LIST_RESPONSE &&
+              frame.header.request_id == request_id &&
+              decode_catalog(frame.payload, frame.header.payload_length, catalog);
+    if (ok)
+    {
+        peer_scores.record_rtt(port, std::chrono::duration<double>(std::chrono::steady_clock::now() - sent_at).count());
+        peer_scores.record_capacity(port, frame.header.length);
+        peer_scores.record_success(port);
+    }
+    else
+    {
+        peer_scores.record_failure(port);
+    }
+    connection_pool.release(conn, ok);
+    return ok;
+}
+
+// Seeders that predate OP_AVAILABILITY answer with an error, and one that
+// cannot be reached or is slow to answer will fail its transfer anyway, so
+// all of them are taken to hold the whole file. The short timeout keeps one
+// stalled seeder from holding up the start of the download.
+bool Client::fetch_availability(int port, int file_id, PieceAvailability &availability)
+{
+    availability.complete = true;
+    availability.piece_size = JOURNAL_CHUNK_SIZE;
+    availability.bitmap.clear();
+    availability.source_version = 0;
+    PeerConnection *conn = connection_pool.acquire(port);
+    if (!conn)
+        return false;
+    set_io_timeouts(conn->fd, AVAILABILITY_TIMEOUT_SECONDS);
+    Frame frame;
+    uint32_t request_id = conn->next_request_id++;
+    bool ok = send_all(conn->fd, encode_frame(make_header(OP_AVAILABILITY, request_id, file_id))) &&
+              read_frame(conn->fd, conn->decoder, frame) && frame.header.request_id == request_id &&
+              (frame.header.opcode == OP_AVAILABILITY_RESPONSE || frame.header.opcode == OP_ERROR);
+    if (ok && frame.header.opcode == OP_AVAILABILITY_RESPONSE && frame.header.length > 0)
+        availability = decode_availability(frame.header, frame.payload);
+    else if (ok && frame.header.opcode == OP_AVAILABILITY_RESPONSE)
+        availability.source_version = frame.header.offset;
+    set_io_timeouts(conn->fd, IO_TIMEOUT_SECONDS);
+    connection_pool.release(conn, ok);
+    return ok;
+}
+
 void Client::list_available_files()
 {
     std::cout << "\nSearching for files...";
-    available_files.clear();
-    std::vector<pthread_t> threads;
-    for (int p : ports)
+    discover_peers(false);
     {
-        if (p != listen_port)
+        std::lock_guard<std::mutex> lock(files_mutex);
+        available_files.clear();
+        for (const auto &peer : peer_catalogs)
         {
-            pthread_t thread;
-            int *port_ptr = new int(p);
-            pthread_create(&thread, nullptr, request_files_helper, new RequestArgs{port_ptr, this});
-            threads.push_back(thread);
+            for (const auto &entry : peer.second.files)
+            {
+                int key = entry.first;
+                std::string local_path = "files/" + std::to_string(key) + "/" + entry.second.filename;
+                if (access(local_path.c_str(), F_OK) == 0 && access(journal_path(local_path).c_str(), F_OK) != 0)
+                    continue;
+                available_files[key] = entry.second;
+            }
         }
     }
-    for (pthread_t &thread : threads)
-    {
-        pthread_join(thread, nullptr);
-    }
     std::cout << " done.\n";
     if (available_files.empty())
     {
@@ -91,6 +218,36 @@ void Client::list_available_files()
     }
 }
 
+// Fans out one LIST per peer in parallel; with only_stale, peers whose cached
+// catalog is younger than CATALOG_TTL_SECONDS are skipped.
+void Client::discover_peers(bool only_stale)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::vector<pthread_t> threads;
+    for (int p : ports)
+    {
+        if (p == listen_port)
+            continue;
+        if (only_stale)
+        {
+            std::lock_guard<std::mutex> lock(files_mutex);
+            auto it = peer_catalogs.find(p);
+            if (it != peer_catalogs.end() && it->second.reachable &&
+                std::chrono::duration<double>(now - it->second.fetched_at).count() < CATALOG_TTL_SECONDS)
+                continue;
+        }
+        pthread_t thread;
+        int *port_ptr = new int(p);
+        pthread_create(&thread, nullptr, request_files_helper, new RequestArgs{port_ptr, this});
+        threads.push_back(thread);
+    }
+    for (pthread_t &thread : threads)
+    {
+        pthread_join(thread, nullptr);
+    }
+    peer_scores.save(false);
+}
+
 void *Client::request_files_helper(void *arg)
 {
     RequestArgs *args = static_cast<RequestArgs *>(arg);
@@ -105,56 +262,113 @@ void *Client::request_files(int *port_ptr)
     delete port_ptr;
     if (port == listen_port)
         return nullptr;
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
+    std::map<int, FileInfo> catalog;
+    bool reachable = fetch_catalog(port, catalog);
+    std::lock_guard<std::mutex> lock(files_mutex);
+    PeerCatalog &peer = peer_catalogs[port];
+    peer.reachable = reachable;
+    peer.files = catalog;
+    peer.fetched_at = std::chrono::steady_clock::now();
+    return nullptr;
+}
+
+// Splits the ranges still to fetch into one contiguous share per peer, sized
+// in proportion to each peer's weight; stealing evens out any misestimate.
+static void assign_shares(ChunkScheduler &scheduler, const std::vector<ByteRange> &ranges, uint64_t total, const std::vector<double> &weights)
+{
+    int num_peers = weights.size();
+    double weight_sum = 0.0;
+    for (double weight : weights)
+        weight_sum += std::max(weight, 0.0);
+    std::vector<uint64_t> share_end(num_peers);
+    double cumulative = 0.0;
+    for (int i = 0; i < num_peers; i++)
     {
-        perror("Failed to create socket");
-        return nullptr;
+        cumulative += weight_sum > 0.0 ? std::max(weights[i], 0.0) : 1.0;
+        share_end[i] = (uint64_t)(total * (cumulative / (weight_sum > 0.0 ? weight_sum : num_peers)));
     }
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0)
+    share_end[num_peers - 1] = total;
+    uint64_t assigned = 0;
+    int peer = 0;
+    for (ByteRange range : ranges)
     {
-        send(sock, "LIST", 4, 0);
-        char buffer[1024];
-        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
-        if (n > 0)
+        while (range.length > 0)
         {
-            buffer[n] = '\0';
-            std::string data(buffer);
-            size_t pos = 0;
-            std::lock_guard<std::mutex> lock(files_mutex);
-            while ((pos = data.find('\n')) != std::string::npos)
+            while (assigned >= share_end[peer])
+                peer++;
+            uint64_t length = std::min(range.length, share_end[peer] - assigned);
+            scheduler.assign(peer, {range.offset, length});
+            range.offset += length;
+            range.length -= length;
+            assigned += length;
+        }
+    }
+}
+
+// Partial seeders: every piece goes to one of the peers holding it, rarest
+// pieces first so they are fetched while their few holders are still around,
+// and among the holders to the one with the least weighted work so far.
+// Pieces nobody holds are left out and keep the download from completing.
+static uint64_t assign_rarest_first(ChunkScheduler &scheduler, const std::vector<ByteRange> &ranges,
+                                    const std::vector<PieceAvailability> &availabilities, const std::vector<double> &weights, uint64_t piece_size)
+{
+    struct Piece
+    {
+        ByteRange range;
+        std::vector<int> holders;
+    };
+    std::vector<Piece> pieces;
+    uint64_t unheld = 0;
+    for (const ByteRange &range : ranges)
+    {
+        uint64_t offset = range.offset;
+        uint64_t end = range.offset + range.length;
+        while (offset < end)
+        {
+            Piece piece;
+            piece.range = {offset, std::min(end, (offset / piece_size + 1) * piece_size) - offset};
+            for (size_t i = 0; i < availabilities.size(); i++)
             {
-                std::string f = data.substr(0, pos);
-                data.erase(0, pos + 1);
-                size_t bracket_pos = f.find("] ");
-                if (bracket_pos != std::string::npos && f[0] == '[')
-                {
-                    int key = std::stoi(f.substr(1, bracket_pos - 1));
-                    std::string rest = f.substr(bracket_pos + 2);
-                    size_t dash_pos = rest.find(" - ");
-                    std::string filename = rest.substr(0, dash_pos);
-                    size_t size_start = dash_pos + 3;
-                    size_t size_end = rest.find(" bytes");
-                    std::string size_str = rest.substr(size_start, size_end - size_start);
-                    long file_size = std::stol(size_str);
-                    std::string local_path = "files/" + std::to_string(key) + "/" + filename;
-                    FILE *local_file = fopen(local_path.c_str(), "rb");
-                    if (local_file)
-                    {
-                        fclose(local_file);
-                        continue;
-                    }
-                    available_files[key] = {filename, file_size};
-                }
+                if (availabilities[i].covers(piece.range))
+                    piece.holders.push_back(i);
             }
+            offset += piece.range.length;
+            if (piece.holders.empty())
+                unheld += piece.range.length;
+            else
+                pieces.push_back(piece);
         }
     }
-    close(sock);
-    return nullptr;
+    std::stable_sort(pieces.begin(), pieces.end(), [](const Piece &a, const Piece &b)
+                     { return a.holders.size() < b.holders.size(); });
+    std::vector<double> load(weights.size(), 0.0);
+    std::vector<std::vector<ByteRange>> shares(weights.size());
+    for (const Piece &piece : pieces)
+    {
+        int best = -1;
+        double best_cost = 0.0;
+        for (int holder : piece.holders)
+        {
+            double cost = (load[holder] + piece.range.length) / std::max(weights[holder], 1.0);
+            if (best < 0 || cost < best_cost)
+            {
+                best = holder;
+                best_cost = cost;
+            }
+        }
+        load[best] += piece.range.length;
+        std::vector<ByteRange> &share = shares[best];
+        if (!share.empty() && share.back().offset + share.back().length == piece.range.offset)
+            share.back().length += piece.range.length;
+        else
+            share.push_back(piece.range);
+    }
+    for (size_t i = 0; i < shares.size(); i++)
+    {
+        for (const ByteRange &range : shares[i])
+            scheduler.assign(i, range);
+    }
+    return unheld;
 }
 
 void Client::download_file()
@@ -167,264 +381,576 @@ void Client::download_file()
     {
         std::cout << "Failed.\n";
         std::cout << "No seeders for file ID " << file_id << "\n";
+        return;
+    }
+    long file_size = available_files[file_id].size;
+    std::string filename = available_files[file_id].filename;
+    std::vector<int> available_ports = find_ports_with_file(file_id, filename);
+    std::cout << "Found " << available_ports.size() << " seeder/s.\n";
+    if (available_ports.empty())
+    {
+        std::cout << "No available ports found for this file.\n";
+        return;
     }
+    int priority = 0;
+    std::cout << "Enter priority (higher runs first): ";
+    if (!(std::cin >> priority))
+    {
+        std::cin.clear();
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        priority = 0;
+    }
+    if (!download_manager.add(file_id, filename, file_size, available_ports, priority))
+    {
+        std::cout << "File ID " << file_id << " is already being downloaded.\n";
+        return;
+    }
+    std::cout << "Download queued. File: [" << file_id << "] " << filename << " (" << file_size << " bytes)\n";
+}
+
+void Client::pause_download()
+{
+    int file_id;
+    std::cout << "\nEnter file ID: ";
+    std::cin >> file_id;
+    if (download_manager.pause(file_id))
+        std::cout << "Download paused.\n";
+    else
+        std::cout << "No queued or running download for file ID " << file_id << "\n";
+}
+
+void Client::resume_download()
+{
+    int file_id;
+    std::cout << "\nEnter file ID: ";
+    std::cin >> file_id;
+    if (download_manager.resume(file_id))
+        std::cout << "Download resumed.\n";
+    else
+        std::cout << "No paused or failed download for file ID " << file_id << "\n";
+}
+
+void Client::cancel_download()
+{
+    int file_id;
+    std::cout << "\nEnter file ID: ";
+    std::cin >> file_id;
+    if (download_manager.cancel(file_id))
+        std::cout << "Download cancelled.\n";
     else
+        std::cout << "No active download for file ID " << file_id << "\n";
+}
+
+static std::string download_path(const DownloadJob &job)
+{
+    return "files/" + std::to_string(job.file_id) + "/" + job.filename;
+}
+
+// The source version most seeders report; ties go to the earliest seeder.
+// Zero means no seeder reported one.
+static uint64_t agreed_source_version(const std::vector<PieceAvailability> &availabilities)
+{
+    uint64_t best = 0;
+    int best_count = 0;
+    for (size_t i = 0; i < availabilities.size(); i++)
     {
-        int seeders_count = count_sources(file_id, available_files[file_id].filename);
-        long file_size = available_files[file_id].size;
-        std::string filename = available_files[file_id].filename;
-        std::cout << "Found " << seeders_count << " seeder/s.\n";
-        std::cout << "Download started. File: [" << file_id << "] " << filename << " (" << file_size << " bytes)\n";
-        std::vector<int> available_ports = find_ports_with_file(file_id, filename);
-        if (available_ports.empty())
-        {
-            std::cout << "No available ports found for this file.\n";
-            return;
-        }
-        std::string dir_path = "files/" + std::to_string(file_id);
-        mkdir(dir_path.c_str(), 0700);
-        std::string file_path = dir_path + "/" + filename;
-        FILE *shared_file = fopen(file_path.c_str(), "w+b");
-        if (!shared_file)
-        {
-            std::cout << "Failed to create file.\n";
-            return;
-        }
-        fseek(shared_file, file_size - 1, SEEK_SET);
-        current_downloads[file_id] = {filename, file_size, 0};
-        int num_chunks = file_size / 32 + (file_size % 32 != 0 ? 1 : 0);
-        int num_ports = available_ports.size();
-        std::cout << "Downloading " << num_chunks << " chunks using " << num_ports << " port/s...\n";
-        std::vector<std::vector<ChunkInfo>> port_chunks(num_ports);
-        int current_port = 0;
-        for (int i = 0; i < num_chunks; i++)
-        {
-            ChunkInfo chunk;
-            chunk.file_id = file_id;
-            chunk.filename = filename;
-            chunk.start_byte = i * 32;
-            long remaining_bytes = file_size - chunk.start_byte;
-            if (remaining_bytes > 32)
-            {
-                chunk.chunk_size = 32;
-            }
-            else
-            {
-                chunk.chunk_size = remaining_bytes;
-            }
-            port_chunks[current_port].push_back(chunk);
-            current_port++;
-            if (current_port >= num_ports)
-                current_port = 0;
-        }
-        std::vector<pthread_t> download_threads;
-        for (int i = 0; i < num_ports; i++)
-        {
-            PortDownloadInfo *port_info = new PortDownloadInfo();
-            port_info->file_id = file_id;
-            port_info->filename = filename;
-            port_info->port = available_ports[i];
-            port_info->chunks = port_chunks[i];
-            port_info->file_ptr = shared_file;
-            pthread_t thread;
-            pthread_create(&thread, nullptr, download_from_specific_port_helper, new DownloadArgs{port_info, this});
-            download_threads.push_back(thread);
-        }
-        for (pthread_t thread : download_threads)
+        uint64_t version = availabilities[i].source_version;
+        if (version == 0)
+            continue;
+        int count = 0;
+        for (const PieceAvailability &other : availabilities)
+            count += other.source_version == version;
+        if (count > best_count)
         {
-            pthread_detach(thread);
+            best = version;
+            best_count = count;
         }
     }
+    return best;
 }
 
-void *Client::download_from_specific_port_helper(void *arg)
+// Opens (or, with a matching journal, reopens) the destination and splits the
+// missing ranges across the job's seeders. Runs on the manager's thread.
+bool Client::prepare_download(const DownloadJob &job, JobResources &resources)
 {
-    DownloadArgs *args = static_cast<DownloadArgs *>(arg);
-    void *ret = args->client_ptr->download_from_specific_port(args->port_info);
-    delete args;
-    return ret;
+    long file_size = job.total_size;
+    std::string dir_path = "files/" + std::to_string(job.file_id);
+    mkdir(dir_path.c_str(), 0700);
+    std::string file_path = download_path(job);
+    int num_ports = job.ports.size();
+    std::vector<PieceAvailability> availabilities(num_ports);
+    for (int i = 0; i < num_ports; i++)
+        fetch_availability(job.ports[i], job.file_id, availabilities[i]);
+    // A seeder holding a different revision of the file must not contribute
+    // bytes, or the result would mix the two.
+    uint64_t source_version = agreed_source_version(availabilities);
+    for (int i = 0; i < num_ports; i++)
+    {
+        if (availabilities[i].source_version == 0 || availabilities[i].source_version == source_version)
+            continue;
+        std::cout << "\nSeeder on port " << job.ports[i] << " has a different version of " << job.filename
+                  << "; skipping it.\n";
+        availabilities[i].complete = false;
+        availabilities[i].piece_size = JOURNAL_CHUNK_SIZE;
+        availabilities[i].bitmap.clear();
+    }
+    std::shared_ptr<DownloadJournal> journal =
+        std::make_shared<DownloadJournal>(file_path, job.file_id, job.filename, file_size, source_version);
+    bool resumed = false;
+    if (!journal->open(resumed))
+    {
+        std::cout << "Failed to create download journal.\n";
+        return false;
+    }
+    int fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (resumed ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+    {
+        std::cout << "Failed to create file.\n";
+        return false;
+    }
+    journal->attach(fd);
+    if (file_size > 0 && fallocate(fd, 0, 0, file_size) != 0 && ftruncate(fd, file_size) != 0)
+    {
+        std::cout << "Failed to allocate file.\n";
+        close(fd);
+        return false;
+    }
+    void *data = MAP_FAILED;
+    if (receive_mode == RECEIVE_MODE_MMAP && file_size > 0)
+        data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED)
+    {
+        madvise(data, file_size, MADV_SEQUENTIAL);
+        resources.mapping = std::make_shared<MappedFile>();
+        resources.mapping->fd = fd;
+        resources.mapping->data = static_cast<char *>(data);
+        resources.mapping->size = file_size;
+        resources.mapping->unflushed = 0;
+        resources.mapping->journal = journal;
+        resources.mapping->sync = &sync_thread;
+    }
+    else
+    {
+        resources.writer = std::make_shared<DiskWriter>(fd, file_path, file_size >= DIRECT_IO_MIN_FILE_SIZE, journal);
+    }
+    std::vector<ByteRange> missing = journal->missing_ranges();
+    uint64_t missing_bytes = 0;
+    for (const ByteRange &range : missing)
+        missing_bytes += range.length;
+    resources.resumed_bytes = file_size - (long)missing_bytes;
+    resources.progress = std::make_shared<DownloadProgress>(num_ports);
+    resources.scheduler = std::make_shared<ChunkScheduler>(file_size, missing_bytes, num_ports);
+    bool all_complete = true;
+    for (int i = 0; i < num_ports; i++)
+    {
+        resources.scheduler->set_availability(i, availabilities[i]);
+        all_complete = all_complete && availabilities[i].complete;
+    }
+    std::vector<double> weights = peer_scores.weights(job.ports);
+    if (all_complete)
+    {
+        assign_shares(*resources.scheduler, missing, missing_bytes, weights);
+        return true;
+    }
+    uint64_t unheld = assign_rarest_first(*resources.scheduler, missing, availabilities, weights, JOURNAL_CHUNK_SIZE);
+    if (unheld > 0)
+        std::cout << "\n" << unheld << " bytes of " << job.filename << " are not held by any seeder yet.\n";
+    return true;
+}
+
+void Client::launch_worker(const std::shared_ptr<DownloadJob> &job, int peer_index)
+{
+    PortDownloadInfo *port_info = new PortDownloadInfo();
+    port_info->file_id = job->file_id;
+    port_info->filename = job->filename;
+    port_info->port = job->ports[peer_index];
+    port_info->peer_index = peer_index;
+    port_info->scheduler = job->resources.scheduler;
+    port_info->writer = job->resources.writer;
+    port_info->mapping = job->resources.mapping;
+    port_info->progress = job->resources.progress;
+    port_info->job = job;
+    download_loop.spawn(download_from_peer(port_info));
+}
+
+bool Client::download_complete(const DownloadJob &job)
+{
+    std::string file_path = download_path(job);
+    return access(file_path.c_str(), F_OK) == 0 && access(journal_path(file_path).c_str(), F_OK) != 0;
+}
+
+// Only removes files that still carry a journal, i.e. ones this client was
+// in the middle of writing, never a finished copy.
+void Client::discard_download(const DownloadJob &job)
+{
+    std::string file_path = download_path(job);
+    if (access(journal_path(file_path).c_str(), F_OK) != 0)
+        return;
+    unlink(file_path.c_str());
+    unlink(journal_path(file_path).c_str());
 }
 
-void *Client::download_from_specific_port(PortDownloadInfo *port_info)
+void *Client::download_loop_helper(void *arg)
 {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    static_cast<Client *>(arg)->download_loop.run();
+    return nullptr;
+}
+
+// Takes an idle pooled connection or opens a new one without blocking the
+// engine thread; while the peer is at its connection limit it polls the pool
+// in short sleeps. Sockets stay non-blocking until handed back.
+Task<PeerConnection *> Client::acquire_connection(int port)
+{
+    while (1)
+    {
+        bool may_open;
+        PeerConnection *conn = connection_pool.try_acquire(port, may_open);
+        if (conn)
+        {
+            set_nonblocking(conn->fd, true);
+            co_return conn;
+        }
+        if (may_open)
+            break;
+        co_await download_loop.sleep_for(ENGINE_POLL_SECONDS);
+    }
+    int sock = co_await async_connect(download_loop, port, deadline_after(CONNECT_TIMEOUT_SECONDS));
     if (sock < 0)
     {
-        delete port_info;
-        return nullptr;
+        connection_pool.abandon_slot(port);
+        co_return nullptr;
     }
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port_info->port);
-    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0)
+    PeerConnection *conn = new PeerConnection();
+    conn->port = port;
+    conn->fd = sock;
+    conn->next_request_id = 1;
+    set_io_timeouts(sock, IO_TIMEOUT_SECONDS);
+    auto hello_sent = std::chrono::steady_clock::now();
+    Deadline deadline = deadline_after(IO_TIMEOUT_SECONDS);
+    Frame frame;
+    if (!co_await async_send_all(download_loop, sock, encode_frame(make_header(OP_HELLO, 0, 0, PROTOCOL_MIN_VERSION, MAX_CHUNK_SIZE)), deadline) ||
+        !co_await async_read_frame(download_loop, sock, conn->decoder, frame, deadline) || frame.header.opcode != OP_HELLO_ACK)
     {
+        download_loop.forget(sock);
         close(sock);
-        delete port_info;
-        return nullptr;
+        delete conn;
+        connection_pool.abandon_slot(port);
+        co_return nullptr;
     }
-    char buffer[32];
-    std::string file_path = "files/" + std::to_string(port_info->file_id) + "/" + port_info->filename;
-    for (const auto &chunk : port_info->chunks)
+    auto now = std::chrono::steady_clock::now();
+    conn->max_chunk_size = frame.header.length > 0 ? frame.header.length : MAX_CHUNK_SIZE;
+    conn->handshake_seconds = std::chrono::duration<double>(now - hello_sent).count();
+    conn->last_used = now;
+    peer_scores.record_rtt(port, conn->handshake_seconds);
+    co_return conn;
+}
+
+void Client::release_connection(PeerConnection *conn, bool reusable)
+{
+    if (!conn)
+        return;
+    download_loop.forget(conn->fd);
+    set_nonblocking(conn->fd, false);
+    connection_pool.release(conn, reusable);
+}
+
+// Exponential backoff with jitter: between half and all of
+// RETRY_BASE_SECONDS * 2^(attempt - 1), capped at RETRY_MAX_SECONDS, so peers
+// that failed together do not all come back at the same moment.
+static double retry_delay(int attempt)
+{
+    static thread_local std::mt19937 generator(std::random_device{}());
+    double ceiling = std::min(RETRY_MAX_SECONDS, RETRY_BASE_SECONDS * (1 << std::min(attempt - 1, 16)));
+    return std::uniform_real_distribution<double>(ceiling / 2, ceiling)(generator);
+}
+
+// One coroutine per (download, peer) pair, all multiplexed on the engine
+// thread. It only suspends on socket readiness or a short sleep, never in a
+// blocking call, so a slow peer or a full write queue stalls nothing else.
+// A failed connect or session hands the peer's ranges to the others and is
+// retried after a jittered backoff, up to MAX_PEER_RETRIES times in a row.
+Task<void> Client::download_from_peer(PortDownloadInfo *port_info)
+{
+    std::shared_ptr<DownloadJob> job = port_info->job;
+    int peer_index = port_info->peer_index;
+    ChunkScheduler &scheduler = *port_info->scheduler;
+    int failures = 0;
+    while (job->state == JOB_RUNNING)
     {
-        std::string request = "DOWNLOAD " + std::to_string(chunk.file_id) + " " + std::to_string(chunk.start_byte) + " " + std::to_string(chunk.chunk_size) + "\n";
-        ssize_t sent = send(sock, request.c_str(), request.size(), 0);
-        if (sent < 0)
+        std::vector<ByteRange> unfinished;
+        uint64_t received = 0;
+        PeerConnection *conn = co_await acquire_connection(port_info->port);
+        if (conn && co_await transfer_from_peer(port_info, conn, unfinished, received))
         {
-            continue;
+            peer_scores.record_success(port_info->port);
+            break;
         }
-        long bytes_received = 0;
-        FILE *file = fopen(file_path.c_str(), "r+b");
-        if (!file)
+        peer_scores.record_failure(port_info->port);
+        if (received > 0)
+            failures = 0;
+        if (++failures > MAX_PEER_RETRIES || job->state != JOB_RUNNING || scheduler.remaining() == 0)
         {
-            continue;
+            scheduler.peer_failed(peer_index, unfinished);
+            break;
         }
+        scheduler.suspend_peer(peer_index, unfinished);
+        co_await download_loop.sleep_for(retry_delay(failures));
+        scheduler.resume_peer(peer_index);
+    }
+    sync_thread.post(&peer_scores, [this]
+                     { peer_scores.save(false); });
+    delete port_info;
+    download_manager.worker_finished(job, peer_index);
+}
 
-        fseek(file, chunk.start_byte, SEEK_SET);
-        while (bytes_received < chunk.chunk_size)
+// One session on one connection. Every wait on the peer is bounded by
+// IO_TIMEOUT_SECONDS; on failure the ranges still owed are left in
+// unfinished and the connection is closed rather than pooled.
+Task<bool> Client::transfer_from_peer(PortDownloadInfo *port_info, PeerConnection *conn, std::vector<ByteRange> &unfinished, uint64_t &received)
+{
+    std::shared_ptr<DownloadJob> job = port_info->job;
+    int peer_index = port_info->peer_index;
+    ChunkScheduler &scheduler = *port_info->scheduler;
+    int sock = conn->fd;
+    ChunkSizePolicy policy(MIN_CHUNK_SIZE, conn->max_chunk_size, DEFAULT_CHUNK_SIZE);
+    policy.record_rtt(conn->handshake_seconds);
+    auto started_at = std::chrono::steady_clock::now();
+    auto last_arrival = started_at;
+    FrameDecoder &decoder = conn->decoder;
+    FrameHeader header;
+    std::string scratch;
+    std::map<uint32_t, InFlightRequest> in_flight;
+    size_t ranges_in_flight = 0;
+    bool peer_ok = true;
+    while (job->state == JOB_RUNNING)
+    {
+        std::vector<ByteRange> ranges;
+        ByteRange range;
+        while (ranges_in_flight + ranges.size() < (size_t)pipeline_depth && ranges.size() < RANGES_PER_REQUEST &&
+               scheduler.next_range(peer_index, policy.get_chunk_size(), range, false))
         {
-            long to_read = std::min(32L, chunk.chunk_size - bytes_received);
-            ssize_t n = recv(sock, buffer, to_read, 0);
-            if (n <= 0)
+            ranges.push_back(range);
+        }
+        if (!ranges.empty())
+        {
+            uint32_t request_id = conn->next_request_id++;
+            in_flight[request_id] = {std::deque<ByteRange>(ranges.begin(), ranges.end()), std::chrono::steady_clock::now()};
+            ranges_in_flight += ranges.size();
+            if (!co_await async_send_all(download_loop, sock, encode_frame(make_header(OP_DOWNLOAD_RANGES, request_id, port_info->file_id), encode_ranges(ranges)), deadline_after(IO_TIMEOUT_SECONDS)))
             {
+                peer_ok = false;
                 break;
             }
-            fwrite(buffer, 1, n, file);
-            fflush(file);
-            bytes_received += n;
+        }
+        if (in_flight.empty())
+        {
+            // Nothing of our own left; stay around while other peers still
+            // hold ranges we might steal or hedge and our seeder has.
+            if (!scheduler.can_help(peer_index))
+                break;
+            co_await download_loop.sleep_for(ENGINE_POLL_SECONDS);
+            continue;
+        }
+        if (!co_await send_cancellations(sock, peer_index, scheduler, in_flight))
+        {
+            peer_ok = false;
+            break;
+        }
+        if (!co_await async_read_frame_header(download_loop, sock, decoder, header, deadline_after(IO_TIMEOUT_SECONDS)))
+        {
+            peer_ok = false;
+            break;
+        }
+        // A reply must answer the range it claims to, and fit it, before its
+        // payload is allowed anywhere near the destination file.
+        auto it = in_flight.find(header.request_id);
+        if (it != in_flight.end() && header.opcode == OP_DATA &&
+            (header.offset != it->second.ranges.front().offset || header.payload_length > it->second.ranges.front().length))
+        {
+            peer_ok = false;
+            break;
+        }
+        char *payload;
+        MappedFile *mapping = port_info->mapping.get();
+        if (mapping && it != in_flight.end() && header.opcode == OP_DATA && header.offset <= mapping->size &&
+            header.payload_length <= mapping->size - header.offset)
+        {
+            payload = mapping->data + header.offset;
+        }
+        else
+        {
+            scratch.resize(header.payload_length);
+            payload = &scratch[0];
+        }
+        if (!co_await async_read_payload(download_loop, sock, decoder, payload, header.payload_length,
+                                     deadline_after(IO_TIMEOUT_SECONDS + header.payload_length / MIN_PEER_THROUGHPUT)))
+        {
+            peer_ok = false;
+            break;
+        }
+        if (it == in_flight.end())
+            continue;
+        ByteRange requested = it->second.ranges.front();
+        auto sent_at = it->second.sent_at;
+        if (header.opcode != OP_DATA ||
+            (header.payload_length == 0 && requested.length > 0 && !(header.flags & (FLAG_CANCELLED | FLAG_UNAVAILABLE))))
+        {
+            peer_ok = false;
+            break;
+        }
+        it->second.ranges.pop_front();
+        ranges_in_flight--;
+        if (it->second.ranges.empty())
+            in_flight.erase(it);
+        if (header.flags & FLAG_CANCELLED)
+            continue;
+        if (header.flags & FLAG_UNAVAILABLE)
+        {
+            scheduler.unavailable(peer_index, requested);
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto started = std::max(last_arrival, sent_at);
+        policy.record_transfer(header.payload_length, std::chrono::duration<double>(now - started).count());
+        last_arrival = now;
+        if (!scheduler.complete(peer_index, requested, header.payload_length))
+            continue;
+        if (mapping)
+        {
+            mapping->wrote(header.offset, header.payload_length);
+        }
+        else
+        {
+            WriteResult result;
+            while ((result = port_info->writer->try_write(header.offset, payload, header.payload_length)) == WRITE_FULL)
+                co_await download_loop.sleep_for(ENGINE_POLL_SECONDS);
+            if (result == WRITE_FAILED)
             {
-                std::lock_guard<std::mutex> lock(files_mutex);
-                current_downloads[port_info->file_id].bytes_downloaded += n;
+                std::cerr << "Failed to write chunk at offset " << header.offset << "\n";
+                peer_ok = false;
+                break;
             }
         }
-        fclose(file);
+        if (header.payload_length < requested.length)
+            scheduler.requeue(peer_index, {requested.offset + header.payload_length, requested.length - header.payload_length});
+        port_info->progress->workers[peer_index].bytes.fetch_add(header.payload_length, std::memory_order_relaxed);
+        received += header.payload_length;
     }
-    close(sock);
-    delete port_info;
-    return nullptr;
+    if (!peer_ok)
+    {
+        for (const auto &entry : in_flight)
+            unfinished.insert(unfinished.end(), entry.second.ranges.begin(), entry.second.ranges.end());
+    }
+    peer_scores.record_transfer(port_info->port, received, std::chrono::duration<double>(last_arrival - started_at).count());
+    release_connection(conn, peer_ok && in_flight.empty());
+    co_return peer_ok;
 }
 
-int Client::count_sources(int file_id, const std::string &filename)
+Task<bool> Client::send_cancellations(int sock, int peer_index, ChunkScheduler &scheduler, const std::map<uint32_t, InFlightRequest> &in_flight)
 {
-    int sources_count = 0;
-    for (int target_port : ports)
+    std::string cancels;
+    for (const ByteRange &range : scheduler.take_cancellations(peer_index))
     {
-        if (target_port == listen_port)
-            continue;
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0)
-            continue;
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(target_port);
-        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-        if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0)
-        {
-            send(sock, "LIST", 4, 0);
-            char buffer[1024];
-            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
-            if (n > 0)
+        for (const auto &entry : in_flight)
+        {
+            for (const ByteRange &pending : entry.second.ranges)
             {
-                buffer[n] = '\0';
-                std::string data(buffer);
-                std::string search_pattern = "[" + std::to_string(file_id) + "] " + filename;
-                if (data.find(search_pattern) != std::string::npos)
-                    sources_count++;
+                if (pending.offset == range.offset)
+                    cancels += encode_frame(make_header(OP_CANCEL, entry.first, 0, range.offset));
             }
         }
-        close(sock);
     }
-    return sources_count;
+    co_return cancels.empty() || co_await async_send_all(download_loop, sock, std::move(cancels), deadline_after(IO_TIMEOUT_SECONDS));
 }
 
 std::vector<int> Client::find_ports_with_file(int file_id, const std::string &filename)
 {
+    discover_peers(true);
     std::vector<int> available_ports;
-    for (int target_port : ports)
+    std::lock_guard<std::mutex> lock(files_mutex);
+    for (const auto &peer : peer_catalogs)
     {
-        if (target_port == listen_port)
-            continue;
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0)
+        if (!peer.second.reachable)
             continue;
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(target_port);
-        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-        if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0)
-        {
-            send(sock, "LIST", 4, 0);
-            char buffer[1024];
-            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
-            if (n > 0)
-            {
-                buffer[n] = '\0';
-                std::string data(buffer);
-                std::string search_pattern = "[" + std::to_string(file_id) + "] " + filename;
-                if (data.find(search_pattern) != std::string::npos)
-                    available_ports.push_back(target_port);
-            }
-        }
-        close(sock);
+        auto it = peer.second.files.find(file_id);
+        if (it != peer.second.files.end() && it->second.filename == filename)
+            available_ports.push_back(peer.first);
     }
+    peer_scores.rank(available_ports);
     return available_ports;
 }
 
 void Client::show_download_status()
 {
     cleanup_completed_downloads();
-    if (current_downloads.empty())
+    std::vector<JobStatus> jobs = download_manager.status();
+    if (jobs.empty())
     {
         std::cout << "No active downloads.\n";
     }
     else
     {
         std::cout << "Download status:\n";
-        for (const auto &entry : current_downloads)
+        for (const JobStatus &status : jobs)
         {
-            download_status(&entry);
+            download_status(status);
         }
     }
 }
 
-void Client::download_status(const std::pair<const int, DownloadInfo> *entry)
+static const char *job_state_name(JobState state)
 {
-    std::lock_guard<std::mutex> lock(files_mutex);
-    int file_id = entry->first;
-    const std::string &filename = entry->second.filename;
-    long total_size = entry->second.total_size;
-    double downloaded_kb = static_cast<double>(entry->second.bytes_downloaded) / 1024.0;
-    double total_kb = static_cast<double>(total_size) / 1024.0;
+    switch (state)
+    {
+    case JOB_QUEUED:
+        return "QUEUED";
+    case JOB_RUNNING:
+        return "RUNNING";
+    case JOB_PAUSED:
+        return "PAUSED";
+    case JOB_CANCELLED:
+        return "CANCELLED";
+    case JOB_DONE:
+        return "COMPLETED";
+    case JOB_FAILED:
+        return "FAILED";
+    }
+    return "UNKNOWN";
+}
+
+void Client::download_status(const JobStatus &status)
+{
+    double downloaded_kb = static_cast<double>(status.bytes_downloaded) / 1024.0;
+    double total_kb = static_cast<double>(status.total_size) / 1024.0;
     double percentage = 0.0;
-    if (total_size > 0)
+    if (status.total_size > 0)
     {
-        percentage = (static_cast<double>(entry->second.bytes_downloaded) / total_size) * 100.0;
+        percentage = (static_cast<double>(status.bytes_downloaded) / status.total_size) * 100.0;
     }
-    std::cout << "[" << file_id << "] " << filename << " - "
+    std::cout << "[" << status.file_id << "] " << status.filename << " - "
               << std::fixed << std::setprecision(2) << downloaded_kb
               << " / " << total_kb << " KB ("
-              << std::setprecision(1) << percentage << "%)";
-    if (entry->second.bytes_downloaded >= total_size)
+              << std::setprecision(1) << percentage << "%) - "
+              << job_state_name(status.state);
+    if (status.state == JOB_RUNNING)
     {
-        std::cout << " - COMPLETED";
+        std::cout << ", " << status.workers << " peer/s";
     }
-    std::cout << "\n";
+    std::cout << ", priority " << status.priority << "\n";
 }
 
 void Client::cleanup_completed_downloads()
 {
-    std::lock_guard<std::mutex> lock(files_mutex);
-    auto it = current_downloads.begin();
-    while (it != current_downloads.end())
+    for (const JobStatus &status : download_manager.status())
     {
-        if (it->second.bytes_downloaded >= it->second.total_size)
+        if (status.state == JOB_DONE)
         {
-            std::cout << "Download completed: [" << it->first << "] " << it->second.filename << std::endl;
-            it = current_downloads.erase(it);
+            std::cout << "Download completed: [" << status.file_id << "] " << status.filename << std::endl;
+            download_manager.forget(status.file_id);
         }
-        else
+        else if (status.state == JOB_CANCELLED)
         {
-            it++;
+            download_manager.forget(status.file_id);
         }
     }
-}
\ No newline at end of file
+}
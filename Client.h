@@ -16,23 +16,50 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits>
 #include <iomanip>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <random>
+#include <sys/mman.h>
 #include "server.h"
+#include "ChunkSizePolicy.h"
+#include "ChunkScheduler.h"
+#include "ConnectionPool.h"
+#include "DiskWriter.h"
+#include "DownloadManager.h"
+#include "EventLoop.h"
+#include "PeerScoreboard.h"
+#include "SyncThread.h"
 
-struct DownloadInfo
+const size_t RANGES_PER_REQUEST = MAX_RANGES_PER_REQUEST;
+const double CATALOG_TTL_SECONDS = 30.0;
+const size_t MMAP_WRITEBACK_BYTES = 32 * 1024 * 1024;
+const double ENGINE_POLL_SECONDS = 0.02;
+const int MAX_PEER_RETRIES = 4;
+const double RETRY_BASE_SECONDS = 0.25;
+const double RETRY_MAX_SECONDS = 8.0;
+const double MIN_PEER_THROUGHPUT = 64.0 * 1024;
+const double AVAILABILITY_TIMEOUT_SECONDS = 2.0;
+
+enum ReceiveMode
 {
-    std::string filename;
-    long total_size;
-    long bytes_downloaded;
+    RECEIVE_MODE_WRITE,
+    RECEIVE_MODE_MMAP
 };
 
-struct ChunkInfo
+struct MappedFile : std::enable_shared_from_this<MappedFile>
 {
-    int file_id;
-    std::string filename;
-    long start_byte;
-    long chunk_size;
+    int fd;
+    char *data;
+    size_t size;
+    std::atomic<size_t> unflushed;
+    std::shared_ptr<DownloadJournal> journal;
+    SyncThread *sync;
+    void wrote(uint64_t offset, size_t bytes);
+    ~MappedFile();
 };
 
 struct PortDownloadInfo
@@ -40,28 +67,58 @@ struct PortDownloadInfo
     int file_id;
     std::string filename;
     int port;
-    std::vector<ChunkInfo> chunks;
-    FILE *file_ptr;
+    int peer_index;
+    std::shared_ptr<ChunkScheduler> scheduler;
+    std::shared_ptr<DiskWriter> writer;
+    std::shared_ptr<MappedFile> mapping;
+    std::shared_ptr<DownloadProgress> progress;
+    std::shared_ptr<DownloadJob> job;
+};
+
+struct InFlightRequest
+{
+    std::deque<ByteRange> ranges;
+    std::chrono::steady_clock::time_point sent_at;
 };
 
 struct FileInfo;
 
+struct PeerCatalog
+{
+    bool reachable;
+    std::map<int, FileInfo> files;
+    std::chrono::steady_clock::time_point fetched_at;
+};
+
 class Client
 {
 public:
-    Client(const std::vector<int> &ports, int listen_port, const std::string &directory_path);
+    Client(const std::vector<int> &ports, int listen_port, const std::string &directory_path, int pipeline_depth = 16);
+    ~Client();
+    void set_receive_mode(ReceiveMode mode);
     void run();
 
 private:
     std::vector<int> ports;
     int listen_port;
     std::string directory_path;
+    int pipeline_depth;
+    ReceiveMode receive_mode;
+    ConnectionPool connection_pool;
+    PeerScoreboard peer_scores;
     std::map<int, FileInfo> available_files;
-    std::map<int, DownloadInfo> current_downloads;
+    std::map<int, PeerCatalog> peer_catalogs;
+    DownloadManager download_manager;
+    EventLoop download_loop;
+    pthread_t download_loop_thread_id;
+    SyncThread sync_thread;
     std::mutex files_mutex;
     std::mutex file_write_mutex;
     void print_menu();
+    bool fetch_catalog(int port, std::map<int, FileInfo> &catalog);
+    bool fetch_availability(int port, int file_id, PieceAvailability &availability);
     void list_available_files();
+    void discover_peers(bool only_stale);
     struct RequestArgs
     {
         int *port_ptr;
@@ -70,17 +127,23 @@ private:
     static void *request_files_helper(void *arg);
     void *request_files(int *port_ptr);
     void download_file();
-    struct DownloadArgs
-    {
-        PortDownloadInfo *port_info;
-        Client *client_ptr;
-    };
-    static void *download_from_specific_port_helper(void *arg);
-    void *download_from_specific_port(PortDownloadInfo *port_info);
-    int count_sources(int file_id, const std::string &filename);
+    void pause_download();
+    void resume_download();
+    void cancel_download();
+    friend class DownloadManager;
+    bool prepare_download(const DownloadJob &job, JobResources &resources);
+    void launch_worker(const std::shared_ptr<DownloadJob> &job, int peer_index);
+    bool download_complete(const DownloadJob &job);
+    void discard_download(const DownloadJob &job);
+    static void *download_loop_helper(void *arg);
+    Task<PeerConnection *> acquire_connection(int port);
+    void release_connection(PeerConnection *conn, bool reusable);
+    Task<void> download_from_peer(PortDownloadInfo *port_info);
+    Task<bool> transfer_from_peer(PortDownloadInfo *port_info, PeerConnection *conn, std::vector<ByteRange> &unfinished, uint64_t &received);
+    Task<bool> send_cancellations(int sock, int peer_index, ChunkScheduler &scheduler, const std::map<uint32_t, InFlightRequest> &in_flight);
     std::vector<int> find_ports_with_file(int file_id, const std::string &filename);
     void show_download_status();
-    void download_status(const std::pair<const int, DownloadInfo> *entry);
+    void download_status(const JobStatus &status);
     void cleanup_completed_downloads();
 };
 
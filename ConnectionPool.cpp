@@ -0,0 +1,204 @@
+#include "ConnectionPool.h"
+
+ConnectionPool::ConnectionPool(int max_per_peer, double idle_timeout_seconds)
+{
+    this->max_per_peer = std::max(1, max_per_peer);
+    this->idle_timeout_seconds = idle_timeout_seconds;
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    for (auto &entry : peers)
+    {
+        for (PeerConnection *conn : entry.second.idle)
+            close_connection(conn);
+    }
+}
+
+PeerConnection *ConnectionPool::acquire(int port)
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    reap_idle();
+    PeerPool &pool = peers[port];
+    while (1)
+    {
+        if (!pool.idle.empty())
+        {
+            PeerConnection *conn = pool.idle.back();
+            pool.idle.pop_back();
+            if (is_healthy(conn))
+                return conn;
+            close_connection(conn);
+            pool.open_count--;
+            continue;
+        }
+        if (pool.open_count < max_per_peer)
+        {
+            pool.open_count++;
+            lock.unlock();
+            PeerConnection *conn = open_connection(port);
+            if (!conn)
+            {
+                lock.lock();
+                pool.open_count--;
+                slot_available.notify_one();
+            }
+            return conn;
+        }
+        slot_available.wait(lock);
+    }
+}
+
+// Non-blocking form of acquire for callers that do their own connect and
+// handshake: returns an idle connection, or reserves a slot for a new one
+// (may_open), or neither when the peer is at its limit.
+PeerConnection *ConnectionPool::try_acquire(int port, bool &may_open)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    reap_idle();
+    PeerPool &pool = peers[port];
+    may_open = false;
+    while (!pool.idle.empty())
+    {
+        PeerConnection *conn = pool.idle.back();
+        pool.idle.pop_back();
+        if (is_healthy(conn))
+            return conn;
+        close_connection(conn);
+        pool.open_count--;
+    }
+    if (pool.open_count < max_per_peer)
+    {
+        pool.open_count++;
+        may_open = true;
+    }
+    return nullptr;
+}
+
+void ConnectionPool::abandon_slot(int port)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    peers[port].open_count--;
+    slot_available.notify_one();
+}
+
+void ConnectionPool::release(PeerConnection *conn, bool reusable)
+{
+    if (!conn)
+        return;
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    PeerPool &pool = peers[conn->port];
+    if (reusable)
+    {
+        conn->last_used = std::chrono::steady_clock::now();
+        pool.idle.push_back(conn);
+    }
+    else
+    {
+        close_connection(conn);
+        pool.open_count--;
+    }
+    slot_available.notify_one();
+}
+
+PeerConnection *ConnectionPool::open_connection(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return nullptr;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0 && !wait_connected(sock))
+    {
+        close(sock);
+        return nullptr;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    set_io_timeouts(sock, IO_TIMEOUT_SECONDS);
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    PeerConnection *conn = new PeerConnection();
+    conn->port = port;
+    conn->fd = sock;
+    conn->next_request_id = 1;
+    auto hello_sent = std::chrono::steady_clock::now();
+    Frame frame;
+    if (!send_all(sock, encode_frame(make_header(OP_HELLO, 0, 0, PROTOCOL_MIN_VERSION, MAX_CHUNK_SIZE))) ||
+        !read_frame(sock, conn->decoder, frame) || frame.header.opcode != OP_HELLO_ACK)
+    {
+        close_connection(conn);
+        return nullptr;
+    }
+    auto now = std::chrono::steady_clock::now();
+    conn->max_chunk_size = frame.header.length > 0 ? frame.header.length : MAX_CHUNK_SIZE;
+    conn->handshake_seconds = std::chrono::duration<double>(now - hello_sent).count();
+    conn->last_used = now;
+    return conn;
+}
+
+// Bounds a connect to a dead or unroutable peer by CONNECT_TIMEOUT_SECONDS
+// instead of the kernel's much longer SYN retry budget.
+bool ConnectionPool::wait_connected(int sock)
+{
+    if (errno != EINPROGRESS)
+        return false;
+    pollfd pfd{sock, POLLOUT, 0};
+    int ready;
+    while ((ready = poll(&pfd, 1, (int)(CONNECT_TIMEOUT_SECONDS * 1000))) < 0 && errno == EINTR)
+    {
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    return ready == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+}
+
+// Blocking sends and receives on pooled sockets give up after this long
+// without progress, so a stalled peer cannot hang a caller indefinitely.
+void set_io_timeouts(int fd, double seconds)
+{
+    timeval timeout;
+    timeout.tv_sec = (time_t)seconds;
+    timeout.tv_usec = (suseconds_t)((seconds - timeout.tv_sec) * 1000000);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// An idle connection must have nothing to read: EOF or stray bytes mean the
+// peer went away or the stream is out of sync.
+bool ConnectionPool::is_healthy(PeerConnection *conn)
+{
+    char probe;
+    ssize_t n = recv(conn->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void ConnectionPool::close_connection(PeerConnection *conn)
+{
+    close(conn->fd);
+    delete conn;
+}
+
+void ConnectionPool::reap_idle()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto &entry : peers)
+    {
+        std::vector<PeerConnection *> &idle = entry.second.idle;
+        auto it = idle.begin();
+        while (it != idle.end())
+        {
+            if (std::chrono::duration<double>(now - (*it)->last_used).count() > idle_timeout_seconds)
+            {
+                close_connection(*it);
+                entry.second.open_count--;
+                it = idle.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "Protocol.h"
+
+const double CONNECT_TIMEOUT_SECONDS = 3.0;
+const double IO_TIMEOUT_SECONDS = 10.0;
+
+void set_io_timeouts(int fd, double seconds);
+
+struct PeerConnection
+{
+    int port;
+    int fd;
+    FrameDecoder decoder;
+    uint64_t max_chunk_size;
+    uint32_t next_request_id;
+    double handshake_seconds;
+    std::chrono::steady_clock::time_point last_used;
+};
+
+class ConnectionPool
+{
+public:
+    ConnectionPool(int max_per_peer, double idle_timeout_seconds);
+    ~ConnectionPool();
+    PeerConnection *acquire(int port);
+    PeerConnection *try_acquire(int port, bool &may_open);
+    void abandon_slot(int port);
+    void release(PeerConnection *conn, bool reusable);
+
+private:
+    struct PeerPool
+    {
+        std::vector<PeerConnection *> idle;
+        int open_count;
+    };
+    int max_per_peer;
+    double idle_timeout_seconds;
+    std::mutex pool_mutex;
+    std::condition_variable slot_available;
+    std::map<int, PeerPool> peers;
+    PeerConnection *open_connection(int port);
+    bool wait_connected(int sock);
+    bool is_healthy(PeerConnection *conn);
+    void close_connection(PeerConnection *conn);
+    void reap_idle();
+};
+
+#endif
@@ -0,0 +1,211 @@
+#include "DiskWriter.h"
+
+bool write_at(int fd, const char *data, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+DiskWriter::DiskWriter(int fd, const std::string &path, bool direct_io, const std::shared_ptr<DownloadJournal> &journal,
+                       size_t max_queued_bytes)
+{
+    this->fd = fd;
+    this->journal = journal;
+    this->max_queued_bytes = max_queued_bytes;
+    direct_fd = direct_io ? open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC) : -1;
+    queued_bytes = 0;
+    closing = false;
+    write_failed = false;
+    staging = nullptr;
+    if (posix_memalign(reinterpret_cast<void **>(&staging), DIRECT_IO_ALIGNMENT, MAX_COALESCED_WRITE + 2 * DIRECT_IO_ALIGNMENT) != 0)
+        staging = nullptr;
+    pthread_create(&writer_thread_id, nullptr, writer_thread_helper, this);
+}
+
+// Drains everything still queued before the descriptors are closed, so the
+// last worker to drop the writer leaves a complete file behind, then lets the
+// journal either record the final progress or retire itself.
+DiskWriter::~DiskWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        closing = true;
+    }
+    work_available.notify_all();
+    pthread_join(writer_thread_id, nullptr);
+    if (journal)
+        journal->finish();
+    if (direct_fd >= 0)
+        close(direct_fd);
+    if (fd >= 0)
+        close(fd);
+    free(staging);
+}
+
+// Blocks while the queue is full so a slow disk pushes back on the network
+// threads instead of buffering the whole file in memory.
+bool DiskWriter::write(uint64_t offset, const char *data, size_t length)
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    space_available.wait(lock, [&]
+                         { return write_failed || has_space(length); });
+    if (write_failed)
+        return false;
+    enqueue(offset, data, length);
+    return true;
+}
+
+// For callers that must not block, such as coroutines on the event loop:
+// WRITE_FULL means try again once the writer has made room.
+WriteResult DiskWriter::try_write(uint64_t offset, const char *data, size_t length)
+{
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (write_failed)
+        return WRITE_FAILED;
+    if (!has_space(length))
+        return WRITE_FULL;
+    enqueue(offset, data, length);
+    return WRITE_QUEUED;
+}
+
+bool DiskWriter::has_space(size_t length) const
+{
+    return queued_bytes == 0 || queued_bytes + length <= max_queued_bytes;
+}
+
+void DiskWriter::enqueue(uint64_t offset, const char *data, size_t length)
+{
+    if (length == 0)
+        return;
+    auto it = pending.find(offset);
+    if (it != pending.end())
+    {
+        if (it->second.size() >= length)
+            return;
+        queued_bytes -= it->second.size();
+        it->second.assign(data, length);
+    }
+    else
+    {
+        pending.emplace(offset, std::string(data, length));
+    }
+    queued_bytes += length;
+    work_available.notify_one();
+}
+
+bool DiskWriter::failed()
+{
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return write_failed;
+}
+
+void *DiskWriter::writer_thread_helper(void *arg)
+{
+    return static_cast<DiskWriter *>(arg)->writer_thread();
+}
+
+void *DiskWriter::writer_thread()
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (1)
+    {
+        work_available.wait(lock, [&]
+                            { return closing || !pending.empty(); });
+        if (pending.empty())
+            break;
+        std::vector<std::pair<uint64_t, std::string>> run;
+        size_t length = take_run(run);
+        lock.unlock();
+        bool ok = write_run(run, length);
+        if (ok && journal)
+        {
+            bool flush_due = false;
+            for (const auto &piece : run)
+                flush_due = journal->record(piece.first, piece.second.size()) || flush_due;
+            if (flush_due)
+                journal->flush();
+        }
+        lock.lock();
+        queued_bytes -= length;
+        if (!ok)
+        {
+            write_failed = true;
+            pending.clear();
+            queued_bytes = 0;
+        }
+        space_available.notify_all();
+    }
+    return nullptr;
+}
+
+// Pulls the lowest queued range plus every range that continues it exactly,
+// up to MAX_COALESCED_WRITE, so scattered chunk arrivals reach the disk as
+// a few large sequential writes.
+size_t DiskWriter::take_run(std::vector<std::pair<uint64_t, std::string>> &run)
+{
+    size_t length = 0;
+    auto it = pending.begin();
+    while (it != pending.end())
+    {
+        if (!run.empty() && (it->first != run.back().first + run.back().second.size() ||
+                             length + it->second.size() > MAX_COALESCED_WRITE))
+            break;
+        length += it->second.size();
+        run.emplace_back(it->first, std::move(it->second));
+        it = pending.erase(it);
+    }
+    return length;
+}
+
+bool DiskWriter::write_run(const std::vector<std::pair<uint64_t, std::string>> &run, size_t length)
+{
+    uint64_t start = run.front().first;
+    if (!staging || (run.size() == 1 && (direct_fd < 0 || length > MAX_COALESCED_WRITE)))
+    {
+        for (const auto &piece : run)
+        {
+            if (!write_at(fd, piece.second.data(), piece.second.size(), piece.first))
+                return false;
+        }
+        return true;
+    }
+    // Lay the run out so that file offsets on an alignment boundary are also
+    // aligned in memory, which is what O_DIRECT needs for the middle part.
+    size_t lead = direct_fd >= 0 ? start % DIRECT_IO_ALIGNMENT : 0;
+    char *buffer = staging + lead;
+    size_t copied = 0;
+    for (const auto &piece : run)
+    {
+        memcpy(buffer + copied, piece.second.data(), piece.second.size());
+        copied += piece.second.size();
+    }
+    uint64_t end = start + length;
+    uint64_t aligned_start = (start + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    uint64_t aligned_end = end / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    if (direct_fd < 0 || aligned_end <= aligned_start)
+        return write_at(fd, buffer, length, start);
+    if (aligned_start > start && !write_at(fd, buffer, aligned_start - start, start))
+        return false;
+    if (!write_at(direct_fd, buffer + (aligned_start - start), aligned_end - aligned_start, aligned_start))
+    {
+        // Filesystems without O_DIRECT support reject the write; carry on
+        // through the page cache instead of failing the download.
+        close(direct_fd);
+        direct_fd = -1;
+        if (!write_at(fd, buffer + (aligned_start - start), aligned_end - aligned_start, aligned_start))
+            return false;
+    }
+    if (end > aligned_end && !write_at(fd, buffer + (aligned_end - start), end - aligned_end, aligned_end))
+        return false;
+    return true;
+}
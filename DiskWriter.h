@@ -0,0 +1,65 @@
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <memory>
+#include "DownloadJournal.h"
+
+const size_t WRITE_QUEUE_BYTES = 64 * 1024 * 1024;
+const size_t MAX_COALESCED_WRITE = 8 * 1024 * 1024;
+const long DIRECT_IO_MIN_FILE_SIZE = 1024L * 1024 * 1024;
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+enum WriteResult
+{
+    WRITE_QUEUED,
+    WRITE_FULL,
+    WRITE_FAILED
+};
+
+bool write_at(int fd, const char *data, size_t length, off_t offset);
+
+class DiskWriter
+{
+public:
+    DiskWriter(int fd, const std::string &path, bool direct_io, const std::shared_ptr<DownloadJournal> &journal,
+               size_t max_queued_bytes = WRITE_QUEUE_BYTES);
+    ~DiskWriter();
+    bool write(uint64_t offset, const char *data, size_t length);
+    WriteResult try_write(uint64_t offset, const char *data, size_t length);
+    bool failed();
+
+private:
+    int fd;
+    int direct_fd;
+    size_t max_queued_bytes;
+    size_t queued_bytes;
+    bool closing;
+    bool write_failed;
+    char *staging;
+    std::shared_ptr<DownloadJournal> journal;
+    std::map<uint64_t, std::string> pending;
+    std::mutex queue_mutex;
+    std::condition_variable work_available;
+    std::condition_variable space_available;
+    pthread_t writer_thread_id;
+    static void *writer_thread_helper(void *arg);
+    void *writer_thread();
+    bool has_space(size_t length) const;
+    void enqueue(uint64_t offset, const char *data, size_t length);
+    size_t take_run(std::vector<std::pair<uint64_t, std::string>> &run);
+    bool write_run(const std::vector<std::pair<uint64_t, std::string>> &run, size_t length);
+};
+
+#endif
@@ -0,0 +1,295 @@
+#include "DownloadJournal.h"
+
+static const char JOURNAL_MAGIC[8] = {'S', 'E', 'E', 'D', 'J', 'N', 'L', '2'};
+
+std::string journal_path(const std::string &data_path)
+{
+    return data_path + JOURNAL_SUFFIX;
+}
+
+bool is_journal_path(const std::string &path)
+{
+    return path.size() > JOURNAL_SUFFIX.size() &&
+           path.compare(path.size() - JOURNAL_SUFFIX.size(), JOURNAL_SUFFIX.size(), JOURNAL_SUFFIX) == 0;
+}
+
+// What a resumed download has to match: the catalog's ID, name and size
+// plus the version (mtime) the seeders reported for the source, so a file
+// rewritten in place at the same size starts over instead of mixing data.
+static uint64_t source_fingerprint(int file_id, const std::string &filename, uint64_t total_size, uint64_t source_version)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    auto mix = [&hash](const void *data, size_t length)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < length; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+    mix(&file_id, sizeof(file_id));
+    mix(filename.data(), filename.size());
+    mix(&total_size, sizeof(total_size));
+    mix(&source_version, sizeof(source_version));
+    return hash;
+}
+
+DownloadJournal::DownloadJournal(const std::string &data_path, int file_id, const std::string &filename, uint64_t total_size, uint64_t source_version)
+{
+    this->data_path = data_path;
+    this->path = journal_path(data_path);
+    this->file_id = file_id;
+    this->filename = filename;
+    this->total_size = total_size;
+    this->source_version = source_version;
+    num_chunks = (total_size + JOURNAL_CHUNK_SIZE - 1) / JOURNAL_CHUNK_SIZE;
+    fingerprint = source_fingerprint(file_id, filename, total_size, source_version);
+    fd = -1;
+    data_fd = -1;
+    unsynced_bytes = 0;
+    last_sync = std::chrono::steady_clock::now();
+}
+
+DownloadJournal::~DownloadJournal()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+// Picks up an existing journal when it describes the same source and the
+// partial data file is still there; otherwise starts over with an empty one.
+bool DownloadJournal::open(bool &resumed)
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    resumed = load();
+    return resumed || create();
+}
+
+void DownloadJournal::attach(int data_fd)
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    this->data_fd = data_fd;
+}
+
+// Called once the bytes have reached the data descriptor; they are only
+// marked durable by the next flush, after the data itself is synced. Returns
+// true when enough has accumulated that the caller should flush() soon.
+bool DownloadJournal::record(uint64_t offset, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    uint64_t end = std::min(offset + length, total_size);
+    while (offset < end)
+    {
+        uint64_t chunk = offset / JOURNAL_CHUNK_SIZE;
+        uint64_t chunk_end = std::min((chunk + 1) * JOURNAL_CHUNK_SIZE, end);
+        received[chunk] += chunk_end - offset;
+        if (!is_done(chunk) && received[chunk] >= chunk_length(chunk))
+            bitmap[chunk / 8] |= 1 << (chunk % 8);
+        offset = chunk_end;
+    }
+    unsynced_bytes += length;
+    return unsynced_bytes >= JOURNAL_SYNC_BYTES ||
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - last_sync).count() >= JOURNAL_SYNC_SECONDS;
+}
+
+std::vector<ByteRange> DownloadJournal::missing_ranges()
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    std::vector<ByteRange> ranges;
+    for (uint64_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        if (is_done(chunk))
+            continue;
+        uint64_t offset = chunk * JOURNAL_CHUNK_SIZE;
+        if (!ranges.empty() && ranges.back().offset + ranges.back().length == offset)
+            ranges.back().length += chunk_length(chunk);
+        else
+            ranges.push_back({offset, chunk_length(chunk)});
+    }
+    return ranges;
+}
+
+// Persists progress and, if every chunk is present and the data file has
+// its full size, drops the journal so the file counts as complete. The file
+// takes the source's mtime first, so it is seeded as the same version.
+bool DownloadJournal::finish()
+{
+    if (!flush())
+        return false;
+    std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    for (uint64_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        if (!is_done(chunk))
+            return false;
+    }
+    struct stat data_stat;
+    if (fstat(data_fd, &data_stat) != 0 || (uint64_t)data_stat.st_size != total_size)
+    {
+        std::cerr << "Download of " << filename << " failed verification.\n";
+        return false;
+    }
+    if (source_version != 0)
+    {
+        struct timespec times[2];
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = source_version / 1000000000;
+        times[1].tv_nsec = source_version % 1000000000;
+        if (futimens(data_fd, times) != 0 || fdatasync(data_fd) != 0)
+            return false;
+    }
+    if (unlink(path.c_str()) != 0)
+        return false;
+    sync_directory();
+    return true;
+}
+
+// What can be served from a file that is itself still being downloaded: the
+// chunks its journal has made durable. Without a journal the file is whole.
+bool DownloadJournal::read_availability(const std::string &data_path, PieceAvailability &availability)
+{
+    availability.complete = false;
+    availability.piece_size = 0;
+    availability.bitmap.clear();
+    availability.source_version = 0;
+    int journal_fd = ::open(journal_path(data_path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (journal_fd < 0)
+    {
+        availability.complete = errno == ENOENT;
+        return availability.complete;
+    }
+    JournalHeader header;
+    bool ok = pread(journal_fd, &header, sizeof(header), 0) == sizeof(header) &&
+              memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0 && header.chunk_size > 0 &&
+              header.num_chunks == (header.total_size + header.chunk_size - 1) / header.chunk_size;
+    if (ok)
+    {
+        availability.piece_size = header.chunk_size;
+        availability.source_version = header.source_version;
+        availability.bitmap.assign((header.num_chunks + 7) / 8, 0);
+        ok = pread(journal_fd, availability.bitmap.data(), availability.bitmap.size(), sizeof(header)) == (ssize_t)availability.bitmap.size();
+    }
+    close(journal_fd);
+    if (!ok)
+        availability.bitmap.clear();
+    return ok;
+}
+
+// The size a partial file will have once complete; the data file itself
+// may not have been extended yet.
+bool DownloadJournal::read_total_size(const std::string &data_path, uint64_t &total_size)
+{
+    int journal_fd = ::open(journal_path(data_path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (journal_fd < 0)
+        return false;
+    JournalHeader header;
+    bool ok = pread(journal_fd, &header, sizeof(header), 0) == sizeof(header) &&
+              memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0;
+    close(journal_fd);
+    if (ok)
+        total_size = header.total_size;
+    return ok;
+}
+
+bool DownloadJournal::load()
+{
+    int journal_fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (journal_fd < 0)
+        return false;
+    JournalHeader header;
+    struct stat data_stat;
+    bitmap.assign((num_chunks + 7) / 8, 0);
+    bool header_ok = pread(journal_fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0 && header.file_id == (uint32_t)file_id;
+    if (header_ok && header.fingerprint != fingerprint)
+        std::cerr << "Source of " << filename << " changed since the download started; starting over.\n";
+    if (!header_ok || header.total_size != total_size || header.chunk_size != JOURNAL_CHUNK_SIZE ||
+        header.fingerprint != fingerprint || header.num_chunks != num_chunks ||
+        pread(journal_fd, bitmap.data(), bitmap.size(), sizeof(header)) != (ssize_t)bitmap.size() ||
+        stat(data_path.c_str(), &data_stat) != 0 || (uint64_t)data_stat.st_size != total_size)
+    {
+        close(journal_fd);
+        return false;
+    }
+    fd = journal_fd;
+    received.assign(num_chunks, 0);
+    for (uint64_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        if (is_done(chunk))
+            received[chunk] = chunk_length(chunk);
+    }
+    return true;
+}
+
+// The journal is made durable before the data file is truncated, so a crash
+// can never leave a partial file behind without its sidecar.
+bool DownloadJournal::create()
+{
+    int journal_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (journal_fd < 0)
+        return false;
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.file_id = file_id;
+    header.total_size = total_size;
+    header.chunk_size = JOURNAL_CHUNK_SIZE;
+    header.fingerprint = fingerprint;
+    header.num_chunks = num_chunks;
+    header.source_version = source_version;
+    bitmap.assign((num_chunks + 7) / 8, 0);
+    received.assign(num_chunks, 0);
+    if (pwrite(journal_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(journal_fd, bitmap.data(), bitmap.size(), sizeof(header)) != (ssize_t)bitmap.size() ||
+        fdatasync(journal_fd) != 0)
+    {
+        close(journal_fd);
+        unlink(path.c_str());
+        return false;
+    }
+    fd = journal_fd;
+    sync_directory();
+    return true;
+}
+
+// Marks durable what had been recorded when the flush started. The syncs run
+// without the journal lock, so record() never waits on the disk.
+bool DownloadJournal::flush()
+{
+    std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    std::vector<uint8_t> snapshot;
+    int journal_fd, synced_fd;
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        unsynced_bytes = 0;
+        last_sync = std::chrono::steady_clock::now();
+        journal_fd = fd;
+        synced_fd = data_fd;
+        snapshot = bitmap;
+    }
+    if (journal_fd < 0 || synced_fd < 0 || fdatasync(synced_fd) != 0)
+        return false;
+    return pwrite(journal_fd, snapshot.data(), snapshot.size(), sizeof(JournalHeader)) == (ssize_t)snapshot.size() &&
+           fdatasync(journal_fd) == 0;
+}
+
+bool DownloadJournal::is_done(uint64_t chunk) const
+{
+    return bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
+uint64_t DownloadJournal::chunk_length(uint64_t chunk) const
+{
+    return std::min(JOURNAL_CHUNK_SIZE, total_size - chunk * JOURNAL_CHUNK_SIZE);
+}
+
+void DownloadJournal::sync_directory()
+{
+    std::string dir = data_path.substr(0, data_path.find_last_of('/') + 1);
+    int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return;
+    fsync(dir_fd);
+    close(dir_fd);
+}
@@ -0,0 +1,76 @@
+#ifndef DOWNLOAD_JOURNAL_H
+#define DOWNLOAD_JOURNAL_H
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Protocol.h"
+
+const std::string JOURNAL_SUFFIX = ".journal";
+const uint64_t JOURNAL_CHUNK_SIZE = 1024 * 1024;
+const uint64_t JOURNAL_SYNC_BYTES = 16 * 1024 * 1024;
+const double JOURNAL_SYNC_SECONDS = 1.0;
+
+std::string journal_path(const std::string &data_path);
+bool is_journal_path(const std::string &path);
+
+// Sidecar next to an in-progress download recording which JOURNAL_CHUNK_SIZE
+// chunks are safely on disk. Its presence marks the data file as partial.
+class DownloadJournal
+{
+public:
+    DownloadJournal(const std::string &data_path, int file_id, const std::string &filename, uint64_t total_size, uint64_t source_version);
+    ~DownloadJournal();
+    bool open(bool &resumed);
+    void attach(int data_fd);
+    bool record(uint64_t offset, uint64_t length);
+    bool flush();
+    std::vector<ByteRange> missing_ranges();
+    bool finish();
+    static bool read_availability(const std::string &data_path, PieceAvailability &availability);
+    static bool read_total_size(const std::string &data_path, uint64_t &total_size);
+
+private:
+    struct JournalHeader
+    {
+        char magic[8];
+        uint32_t file_id;
+        uint32_t reserved;
+        uint64_t total_size;
+        uint64_t chunk_size;
+        uint64_t fingerprint;
+        uint64_t num_chunks;
+        uint64_t source_version;
+    };
+    std::string data_path;
+    std::string path;
+    int file_id;
+    std::string filename;
+    uint64_t total_size;
+    uint64_t num_chunks;
+    uint64_t source_version;
+    uint64_t fingerprint;
+    int fd;
+    int data_fd;
+    std::vector<uint8_t> bitmap;
+    std::vector<uint64_t> received;
+    uint64_t unsynced_bytes;
+    std::chrono::steady_clock::time_point last_sync;
+    std::mutex journal_mutex;
+    std::mutex flush_mutex;
+    bool load();
+    bool create();
+    bool is_done(uint64_t chunk) const;
+    uint64_t chunk_length(uint64_t chunk) const;
+    void sync_directory();
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include "DownloadManager.h"
+#include "Client.h"
+
+DownloadProgress::DownloadProgress(int num_workers) : workers(num_workers)
+{
+}
+
+uint64_t DownloadProgress::total() const
+{
+    uint64_t bytes = 0;
+    for (const WorkerProgress &worker : workers)
+        bytes += worker.bytes.load(std::memory_order_relaxed);
+    return bytes;
+}
+
+DownloadManager::DownloadManager(Client *client, int max_active_workers, int max_workers_per_peer)
+{
+    this->client = client;
+    this->max_active_workers = std::max(1, max_active_workers);
+    this->max_workers_per_peer = std::max(1, max_workers_per_peer);
+    dirty = false;
+    stopping = false;
+    active_workers = 0;
+    next_sequence = 0;
+}
+
+void DownloadManager::start()
+{
+    pthread_create(&dispatch_thread_id, nullptr, dispatch_thread_helper, this);
+}
+
+// Ends the dispatcher so the manager can be destroyed. Jobs are left as
+// they are; unfinished ones resume from their journals on the next run.
+void DownloadManager::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(manager_mutex);
+        stopping = true;
+        changed.notify_one();
+    }
+    pthread_join(dispatch_thread_id, nullptr);
+}
+
+bool DownloadManager::add(int file_id, const std::string &filename, long total_size, const std::vector<int> &ports, int priority)
+{
+    std::lock_guard<std::mutex> lock(manager_mutex);
+    auto it = jobs.find(file_id);
+    if (it != jobs.end() && (it->second->prepared || it->second->releasing ||
+                             (it->second->state != JOB_DONE && it->second->state != JOB_CANCELLED && it->second->state != JOB_FAILED)))
+        return false;
+    std::shared_ptr<DownloadJob> job = std::make_shared<DownloadJob>();
+    job->file_id = file_id;
+    job->filename = filename;
+    job->total_size = total_size;
+    job->priority = priority;
+    job->sequence = next_sequence++;
+    job->ports = ports;
+    job->peer_states.assign(ports.size(), PEER_IDLE);
+    job->active_workers = 0;
+    job->state = JOB_QUEUED;
+    job->prepared = false;
+    job->releasing = false;
+    job->bytes_downloaded = 0;
+    jobs[file_id] = job;
+    dirty = true;
+    changed.notify_one();
+    return true;
+}
+
+bool DownloadManager::pause(int file_id)
+{
+    std::lock_guard<std::mutex> lock(manager_mutex);
+    auto it = jobs.find(file_id);
+    if (it == jobs.end() || (it->second->state != JOB_QUEUED && it->second->state != JOB_RUNNING))
+        return false;
+    DownloadJob &job = *it->second;
+    job.state = JOB_PAUSED;
+    if (job.prepared)
+        job.resources.scheduler->stop();
+    dirty = true;
+    changed.notify_one();
+    return true;
+}
+
+bool DownloadManager::resume(int file_id)
+{
+    std::lock_guard<std::mutex> lock(manager_mutex);
+    auto it = jobs.find(file_id);
+    if (it == jobs.end() || (it->second->state != JOB_PAUSED && it->second->state != JOB_FAILED))
+        return false;
+    it->second->state = JOB_QUEUED;
+    dirty = true;
+    changed.notify_one();
+    return true;
+}
+
+bool DownloadManager::cancel(int file_id)
+{
+    std::unique_lock<std::mutex> lock(manager_mutex);
+    auto it = jobs.find(file_id);
+    if (it == jobs.end() || it->second->state == JOB_DONE || it->second->state == JOB_CANCELLED)
+        return false;
+    std::shared_ptr<DownloadJob> job = it->second;
+    int previous = job->state.exchange(JOB_CANCELLED);
+    if (job->prepared)
+        job->resources.scheduler->stop();
+    if (job->prepared || job->releasing || previous == JOB_RUNNING)
+    {
+        dirty = true;
+        changed.notify_one();
+        return true;
+    }
+    lock.unlock();
+    client->discard_download(*job);
+    return true;
+}
+
+void DownloadManager::worker_finished(const std::shared_ptr<DownloadJob> &job, int peer_index)
+{
+    std::lock_guard<std::mutex> lock(manager_mutex);
+    job->peer_states[peer_index] = PEER_DONE;
+    job->active_workers--;
+    workers_per_port[job->ports[peer_index]]--;
+    active_workers--;
+    dirty = true;
+    changed.notify_one();
+}
+
+std::vector<JobStatus> DownloadManager::status()
+{
+    std::lock_guard<std::mutex> lock(manager_mutex);
+    std::vector<JobStatus> result;
+    for (const auto &entry : jobs)
+    {
+        const DownloadJob &job = *entry.second;
+        long bytes = job.bytes_downloaded;
+        if (job.prepared)
+            bytes = job.resources.resumed_bytes + job.resources.progress->total();
+        else if (job.state == JOB_DONE)
+            bytes = job.total_size;
+        result.push_back({job.file_id, job.filename, job.total_size, bytes, job.priority, job.active_workers,
+                          static_cast<JobState>(job.state.load())});
+    }
+    return result;
+}
+
+void DownloadManager::forget(int file_id)
+{
+    std::lock_guard<std::mutex> lock(manager_mutex);
+    auto it = jobs.find(file_id);
+    if (it != jobs.end() && !it->second->prepared && !it->second->releasing && (it->second->state == JOB_DONE || it->second->state == JOB_CANCELLED))
+        jobs.erase(it);
+}
+
+void *DownloadManager::dispatch_thread_helper(void *arg)
+{
+    return static_cast<DownloadManager *>(arg)->dispatch_thread();
+}
+
+// All admission, preparation and teardown happens on this one thread, so a
+// job is never prepared twice or released while being launched. Workers and
+// the menu only flip states and counters, then wake it.
+void *DownloadManager::dispatch_thread()
+{
+    std::unique_lock<std::mutex> lock(manager_mutex);
+    while (1)
+    {
+        changed.wait(lock, [this]
+                     { return dirty || stopping; });
+        if (stopping)
+            break;
+        dirty = false;
+        while (settle_stopped_job(lock))
+        {
+        }
+        std::shared_ptr<DownloadJob> job;
+        int peer_index;
+        while (pick_launch(job, peer_index))
+        {
+            if (!job->prepared)
+            {
+                JobResources resources;
+                lock.unlock();
+                bool ok = client->prepare_download(*job, resources);
+                lock.lock();
+                if (!ok)
+                {
+                    release_slot(*job, peer_index);
+                    if (job->state == JOB_RUNNING)
+                        job->state = JOB_FAILED;
+                    continue;
+                }
+                job->resources = resources;
+                job->prepared = true;
+                if (job->state != JOB_RUNNING)
+                {
+                    resources.scheduler->stop();
+                    release_slot(*job, peer_index);
+                    dirty = true;
+                    continue;
+                }
+            }
+            lock.unlock();
+            client->launch_worker(job, peer_index);
+            lock.lock();
+        }
+    }
+    return nullptr;
+}
+
+// Tears down one job that has no workers left and will not get more: it
+// was paused or cancelled, it finished, or every peer has been tried. The
+// destination is released outside the lock since that drains the writer.
+bool DownloadManager::settle_stopped_job(std::unique_lock<std::mutex> &lock)
+{
+    std::shared_ptr<DownloadJob> job;
+    for (const auto &entry : jobs)
+    {
+        DownloadJob &candidate = *entry.second;
+        if (!candidate.prepared || candidate.active_workers > 0)
+            continue;
+        bool waiting = std::find(candidate.peer_states.begin(), candidate.peer_states.end(), PEER_IDLE) != candidate.peer_states.end();
+        if (candidate.state == JOB_RUNNING && waiting && candidate.resources.scheduler->remaining() > 0)
+            continue;
+        job = entry.second;
+        break;
+    }
+    if (!job)
+        return false;
+    JobResources resources = job->resources;
+    job->resources = JobResources();
+    job->bytes_downloaded = resources.resumed_bytes + resources.progress->total();
+    job->prepared = false;
+    job->releasing = true;
+    lock.unlock();
+    resources = JobResources();
+    bool discarded = job->state == JOB_CANCELLED;
+    bool complete = !discarded && client->download_complete(*job);
+    if (discarded)
+        client->discard_download(*job);
+    lock.lock();
+    job->releasing = false;
+    if (job->state == JOB_CANCELLED && !discarded)
+        client->discard_download(*job);
+    job->peer_states.assign(job->ports.size(), PEER_IDLE);
+    if (complete && job->state != JOB_CANCELLED)
+        job->state = JOB_DONE;
+    else if (job->state == JOB_RUNNING)
+        job->state = JOB_FAILED;
+    return true;
+}
+
+// Chooses the next worker to start: the highest-priority job (oldest first
+// among equals) with a peer it has not tried yet, within the global and the
+// per-peer worker limits.
+bool DownloadManager::pick_launch(std::shared_ptr<DownloadJob> &job, int &peer_index)
+{
+    if (active_workers >= max_active_workers)
+        return false;
+    std::vector<std::shared_ptr<DownloadJob>> order;
+    for (const auto &entry : jobs)
+    {
+        const DownloadJob &candidate = *entry.second;
+        if (candidate.state == JOB_QUEUED && !candidate.prepared)
+            order.push_back(entry.second);
+        else if (candidate.state == JOB_RUNNING && candidate.prepared && candidate.resources.scheduler->remaining() > 0)
+            order.push_back(entry.second);
+    }
+    std::sort(order.begin(), order.end(), [](const std::shared_ptr<DownloadJob> &a, const std::shared_ptr<DownloadJob> &b)
+              { return a->priority != b->priority ? a->priority > b->priority : a->sequence < b->sequence; });
+    for (const std::shared_ptr<DownloadJob> &candidate : order)
+    {
+        for (size_t i = 0; i < candidate->ports.size(); i++)
+        {
+            if (candidate->peer_states[i] != PEER_IDLE || workers_per_port[candidate->ports[i]] >= max_workers_per_peer)
+                continue;
+            candidate->peer_states[i] = PEER_ACTIVE;
+            candidate->active_workers++;
+            workers_per_port[candidate->ports[i]]++;
+            active_workers++;
+            candidate->state = JOB_RUNNING;
+            job = candidate;
+            peer_index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DownloadManager::release_slot(DownloadJob &job, int peer_index)
+{
+    job.peer_states[peer_index] = PEER_IDLE;
+    job.active_workers--;
+    workers_per_port[job.ports[peer_index]]--;
+    active_workers--;
+}
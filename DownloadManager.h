@@ -0,0 +1,129 @@
+#ifndef DOWNLOAD_MANAGER_H
+#define DOWNLOAD_MANAGER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <unistd.h>
+#include <pthread.h>
+#include "ChunkScheduler.h"
+#include "DiskWriter.h"
+
+const int MAX_ACTIVE_WORKERS = 16;
+const int MAX_WORKERS_PER_PEER = 3;
+
+enum JobState
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_PAUSED,
+    JOB_CANCELLED,
+    JOB_DONE,
+    JOB_FAILED
+};
+
+enum PeerSlotState
+{
+    PEER_IDLE,
+    PEER_ACTIVE,
+    PEER_DONE
+};
+
+// One counter per peer worker, each on its own cache line so workers never
+// share a line or a lock; readers sum them when progress is shown.
+struct alignas(64) WorkerProgress
+{
+    std::atomic<uint64_t> bytes{0};
+};
+
+struct DownloadProgress
+{
+    std::vector<WorkerProgress> workers;
+    explicit DownloadProgress(int num_workers);
+    uint64_t total() const;
+};
+
+struct MappedFile;
+
+// Everything a running job's workers share; built when the job is admitted
+// and dropped once its last worker is gone, which flushes the destination.
+struct JobResources
+{
+    long resumed_bytes;
+    std::shared_ptr<DownloadProgress> progress;
+    std::shared_ptr<ChunkScheduler> scheduler;
+    std::shared_ptr<DiskWriter> writer;
+    std::shared_ptr<MappedFile> mapping;
+};
+
+struct DownloadJob
+{
+    int file_id;
+    std::string filename;
+    long total_size;
+    int priority;
+    uint64_t sequence;
+    std::vector<int> ports;
+    std::vector<int> peer_states;
+    int active_workers;
+    std::atomic<int> state;
+    bool prepared;
+    bool releasing;
+    long bytes_downloaded;
+    JobResources resources;
+};
+
+struct JobStatus
+{
+    int file_id;
+    std::string filename;
+    long total_size;
+    long bytes_downloaded;
+    int priority;
+    int workers;
+    JobState state;
+};
+
+class Client;
+
+class DownloadManager
+{
+public:
+    DownloadManager(Client *client, int max_active_workers, int max_workers_per_peer);
+    void start();
+    void stop();
+    bool add(int file_id, const std::string &filename, long total_size, const std::vector<int> &ports, int priority);
+    bool pause(int file_id);
+    bool resume(int file_id);
+    bool cancel(int file_id);
+    void worker_finished(const std::shared_ptr<DownloadJob> &job, int peer_index);
+    std::vector<JobStatus> status();
+    void forget(int file_id);
+
+private:
+    Client *client;
+    int max_active_workers;
+    int max_workers_per_peer;
+    std::mutex manager_mutex;
+    std::condition_variable changed;
+    bool dirty;
+    bool stopping;
+    pthread_t dispatch_thread_id;
+    std::map<int, std::shared_ptr<DownloadJob>> jobs;
+    std::map<int, int> workers_per_port;
+    int active_workers;
+    uint64_t next_sequence;
+    static void *dispatch_thread_helper(void *arg);
+    void *dispatch_thread();
+    bool settle_stopped_job(std::unique_lock<std::mutex> &lock);
+    bool pick_launch(std::shared_ptr<DownloadJob> &job, int &peer_index);
+    void release_slot(DownloadJob &job, int peer_index);
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "EventLoop.h"
+
+EventLoop::WaitAwaiter::WaitAwaiter(EventLoop &loop, int fd, uint32_t events, Deadline deadline)
+    : loop(loop), events(events), deadline(deadline)
+{
+    waiter.fd = fd;
+    waiter.timed_out = false;
+    waiter.has_timer = false;
+}
+
+void EventLoop::WaitAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    waiter.handle = handle;
+    loop.arm(&waiter, events, deadline);
+}
+
+EventLoop::EventLoop()
+{
+    epoll_fd = -1;
+    wake_fd = -1;
+    stopping = false;
+}
+
+EventLoop::~EventLoop()
+{
+    if (wake_fd >= 0)
+        close(wake_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+bool EventLoop::init()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0)
+        return false;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == 0;
+}
+
+void EventLoop::run()
+{
+    epoll_event events[256];
+    while (!stopping)
+    {
+        while (!ready.empty())
+        {
+            std::coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+        int n = epoll_wait(epoll_fd, events, 256, next_timeout_ms());
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait failed");
+            return;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            Waiter *waiter = static_cast<Waiter *>(events[i].data.ptr);
+            if (!waiter)
+            {
+                uint64_t count;
+                while (read(wake_fd, &count, sizeof(count)) > 0)
+                {
+                }
+                std::lock_guard<std::mutex> lock(spawn_mutex);
+                ready.insert(ready.end(), spawned.begin(), spawned.end());
+                spawned.clear();
+                continue;
+            }
+            if (waiter->has_timer)
+                timers.erase(waiter->timer);
+            ready.push_back(waiter->handle);
+        }
+        expire_timers();
+    }
+}
+
+// Makes run() return after the current batch. Suspended tasks are left
+// as they are; this is meant for shutdown.
+void EventLoop::stop()
+{
+    stopping = true;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write failed");
+}
+
+void EventLoop::spawn(Task<void> task)
+{
+    std::coroutine_handle<> handle = task.detach();
+    {
+        std::lock_guard<std::mutex> lock(spawn_mutex);
+        spawned.push_back(handle);
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write failed");
+}
+
+EventLoop::WaitAwaiter EventLoop::readable(int fd, Deadline deadline)
+{
+    return WaitAwaiter(*this, fd, EPOLLIN, deadline);
+}
+
+EventLoop::WaitAwaiter EventLoop::writable(int fd, Deadline deadline)
+{
+    return WaitAwaiter(*this, fd, EPOLLOUT, deadline);
+}
+
+EventLoop::WaitAwaiter EventLoop::sleep_for(double seconds)
+{
+    return WaitAwaiter(*this, -1, 0, deadline_after(seconds));
+}
+
+// Drops the descriptor from the interest list before it goes back to code
+// that uses it with blocking calls.
+void EventLoop::forget(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+// One-shot registration, so a waiter is resumed at most once per arm and a
+// descriptor that times out can simply be disarmed.
+void EventLoop::arm(Waiter *waiter, uint32_t events, Deadline deadline)
+{
+    if (deadline != Deadline::max())
+    {
+        waiter->timer = timers.emplace(deadline, waiter);
+        waiter->has_timer = true;
+    }
+    if (waiter->fd < 0)
+        return;
+    epoll_event ev{};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = waiter;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, waiter->fd, &ev) != 0 &&
+        (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, waiter->fd, &ev) != 0))
+    {
+        // Not pollable; resume immediately and let the I/O call report it.
+        if (waiter->has_timer)
+            timers.erase(waiter->timer);
+        waiter->has_timer = false;
+        ready.push_back(waiter->handle);
+    }
+}
+
+int EventLoop::next_timeout_ms()
+{
+    if (!ready.empty())
+        return 0;
+    if (timers.empty())
+        return -1;
+    auto wait = timers.begin()->first - std::chrono::steady_clock::now();
+    long ms = std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+    return ms < 0 ? 0 : (int)std::min(ms, 60000L);
+}
+
+void EventLoop::expire_timers()
+{
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() && timers.begin()->first <= now)
+    {
+        Waiter *waiter = timers.begin()->second;
+        timers.erase(timers.begin());
+        waiter->has_timer = false;
+        if (waiter->fd >= 0)
+        {
+            waiter->timed_out = true;
+            epoll_event ev{};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, waiter->fd, &ev);
+        }
+        ready.push_back(waiter->handle);
+    }
+}
+
+Deadline deadline_after(double seconds)
+{
+    return std::chrono::steady_clock::now() +
+           std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+bool set_nonblocking(int fd, bool nonblocking)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return false;
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+Task<int> async_connect(EventLoop &loop, int port, Deadline deadline)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        co_return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        int error = errno;
+        socklen_t length = sizeof(error);
+        if (error != EINPROGRESS || !co_await loop.writable(sock, deadline) ||
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+        {
+            loop.forget(sock);
+            close(sock);
+            co_return -1;
+        }
+    }
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    co_return sock;
+}
+
+Task<bool> async_send_all(EventLoop &loop, int fd, std::string data, Deadline deadline)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && co_await loop.writable(fd, deadline))
+            continue;
+        co_return false;
+    }
+    co_return true;
+}
+
+Task<bool> async_read_frame(EventLoop &loop, int fd, FrameDecoder &decoder, Frame &frame, Deadline deadline)
+{
+    char buffer[64 * 1024];
+    while (!decoder.next(frame))
+    {
+        if (decoder.has_error())
+            co_return false;
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n > 0)
+        {
+            decoder.feed(buffer, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && co_await loop.readable(fd, deadline))
+            continue;
+        co_return false;
+    }
+    co_return true;
+}
+
+// Coroutine counterparts of read_frame_header/read_payload; the payload
+// lands directly in the caller's buffer.
+Task<bool> async_read_frame_header(EventLoop &loop, int fd, FrameDecoder &decoder, FrameHeader &header, Deadline deadline)
+{
+    char buffer[FRAME_HEADER_SIZE];
+    while (!decoder.next_header(header))
+    {
+        if (decoder.has_error())
+            co_return false;
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n > 0)
+        {
+            decoder.feed(buffer, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && co_await loop.readable(fd, deadline))
+            continue;
+        co_return false;
+    }
+    co_return true;
+}
+
+Task<bool> async_read_payload(EventLoop &loop, int fd, FrameDecoder &decoder, char *destination, size_t length, Deadline deadline)
+{
+    size_t received = decoder.take(destination, length);
+    while (received < length)
+    {
+        ssize_t n = recv(fd, destination + received, length - received, 0);
+        if (n > 0)
+        {
+            received += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && co_await loop.readable(fd, deadline))
+            continue;
+        co_return false;
+    }
+    co_return true;
+}
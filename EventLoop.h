@@ -0,0 +1,178 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <type_traits>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "Protocol.h"
+
+template <typename T>
+class Task;
+
+// Tasks start suspended and run when awaited (resuming the awaiter when they
+// finish) or when handed to EventLoop::spawn, in which case they free
+// themselves on completion.
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            TaskPromiseBase &promise = handle.promise();
+            if (promise.continuation)
+                return promise.continuation;
+            if (promise.detached)
+                handle.destroy();
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+    T value{};
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+template <typename T = void>
+class Task
+{
+public:
+    typedef TaskPromise<T> promise_type;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume()
+    {
+        if constexpr (!std::is_void_v<T>)
+            return std::move(handle.promise().value);
+    }
+    std::coroutine_handle<promise_type> detach()
+    {
+        handle.promise().detached = true;
+        return std::exchange(handle, nullptr);
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Single-threaded epoll executor. Only spawn() and stop() may be called from
+// other threads; everything else runs on the thread inside run().
+class EventLoop
+{
+public:
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        int fd;
+        bool timed_out;
+        bool has_timer;
+        std::multimap<Deadline, Waiter *>::iterator timer;
+    };
+    class WaitAwaiter
+    {
+    public:
+        WaitAwaiter(EventLoop &loop, int fd, uint32_t events, Deadline deadline);
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const noexcept { return !waiter.timed_out; }
+
+    private:
+        EventLoop &loop;
+        uint32_t events;
+        Deadline deadline;
+        Waiter waiter;
+    };
+
+    EventLoop();
+    ~EventLoop();
+    bool init();
+    void run();
+    void stop();
+    void spawn(Task<void> task);
+    WaitAwaiter readable(int fd, Deadline deadline = Deadline::max());
+    WaitAwaiter writable(int fd, Deadline deadline = Deadline::max());
+    WaitAwaiter sleep_for(double seconds);
+    void forget(int fd);
+
+private:
+    int epoll_fd;
+    int wake_fd;
+    std::atomic<bool> stopping;
+    std::mutex spawn_mutex;
+    std::vector<std::coroutine_handle<>> spawned;
+    std::deque<std::coroutine_handle<>> ready;
+    std::multimap<Deadline, Waiter *> timers;
+    void arm(Waiter *waiter, uint32_t events, Deadline deadline);
+    int next_timeout_ms();
+    void expire_timers();
+};
+
+Deadline deadline_after(double seconds);
+bool set_nonblocking(int fd, bool nonblocking);
+Task<int> async_connect(EventLoop &loop, int port, Deadline deadline = Deadline::max());
+Task<bool> async_send_all(EventLoop &loop, int fd, std::string data, Deadline deadline = Deadline::max());
+Task<bool> async_read_frame(EventLoop &loop, int fd, FrameDecoder &decoder, Frame &frame, Deadline deadline = Deadline::max());
+Task<bool> async_read_frame_header(EventLoop &loop, int fd, FrameDecoder &decoder, FrameHeader &header, Deadline deadline = Deadline::max());
+Task<bool> async_read_payload(EventLoop &loop, int fd, FrameDecoder &decoder, char *destination, size_t length, Deadline deadline = Deadline::max());
+
+#endif
@@ -0,0 +1,115 @@
+#include "FileCache.h"
+
+CachedFile::~CachedFile()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+FileCache::FileCache(const std::string &dir, size_t capacity)
+{
+    directory_path = dir;
+    this->capacity = capacity;
+}
+
+std::shared_ptr<CachedFile> FileCache::get(int file_id)
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = entries.find(file_id);
+        if (it != entries.end())
+        {
+            lru.splice(lru.begin(), lru, it->second.lru_pos);
+            return it->second.file;
+        }
+    }
+    std::shared_ptr<CachedFile> file = open_file(file_id);
+    if (!file)
+        return file;
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = entries.find(file_id);
+    if (it != entries.end())
+    {
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return it->second.file;
+    }
+    lru.push_front(file_id);
+    entries[file_id] = {file, lru.begin()};
+    while (entries.size() > capacity)
+    {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+    return file;
+}
+
+void FileCache::invalidate(int file_id)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = entries.find(file_id);
+    if (it == entries.end())
+        return;
+    lru.erase(it->second.lru_pos);
+    entries.erase(it);
+}
+
+void FileCache::clear()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    entries.clear();
+    lru.clear();
+}
+
+std::string FileCache::find_file_path(int file_id)
+{
+    std::string file_dir = directory_path + "/" + std::to_string(file_id);
+    DIR *dir = opendir(file_dir.c_str());
+    std::string file_path;
+    if (dir == NULL)
+    {
+        perror("Error opening directory");
+        return file_path;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        if (is_journal_path(name))
+            continue;
+        if (entry->d_type == DT_REG)
+        {
+            file_path = file_dir + "/" + name;
+            break;
+        }
+    }
+    closedir(dir);
+    return file_path;
+}
+
+std::shared_ptr<CachedFile> FileCache::open_file(int file_id)
+{
+    std::string file_path = find_file_path(file_id);
+    if (file_path.empty())
+        return nullptr;
+    int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    std::shared_ptr<CachedFile> file = std::make_shared<CachedFile>();
+    file->file_id = file_id;
+    file->fd = fd;
+    file->path = file_path;
+    file->size = file_stat.st_size;
+    file->mtime = file_stat.st_mtim;
+    file->partial = access(journal_path(file_path).c_str(), F_OK) == 0;
+    file->availability_loaded = false;
+    file->availability_refreshing = false;
+    return file;
+}
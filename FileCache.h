@@ -0,0 +1,57 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "DownloadJournal.h"
+
+struct CachedFile
+{
+    int file_id;
+    int fd;
+    std::string path;
+    long size;
+    struct timespec mtime;
+    // Set when the file still had a journal at open, i.e. it is being
+    // downloaded; the snapshot below is then kept by Server::get_availability.
+    bool partial;
+    std::mutex availability_mutex;
+    std::shared_ptr<const PieceAvailability> availability;
+    std::chrono::steady_clock::time_point availability_loaded_at;
+    bool availability_loaded;
+    bool availability_refreshing;
+    ~CachedFile();
+};
+
+class FileCache
+{
+public:
+    FileCache(const std::string &dir, size_t capacity);
+    std::shared_ptr<CachedFile> get(int file_id);
+    void invalidate(int file_id);
+    void clear();
+
+private:
+    std::string directory_path;
+    size_t capacity;
+    std::mutex cache_mutex;
+    std::list<int> lru;
+    struct CacheEntry
+    {
+        std::shared_ptr<CachedFile> file;
+        std::list<int>::iterator lru_pos;
+    };
+    std::map<int, CacheEntry> entries;
+    std::string find_file_path(int file_id);
+    std::shared_ptr<CachedFile> open_file(int file_id);
+};
+
+#endif
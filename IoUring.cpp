@@ -0,0 +1,274 @@
+#include "IoUring.h"
+
+IoUring::IoUring()
+{
+    ring_fd = -1;
+    event_fd = -1;
+    sq_entries = 0;
+    sq_ring = MAP_FAILED;
+    cq_ring = MAP_FAILED;
+    sq_ring_size = 0;
+    cq_ring_size = 0;
+    sqes = nullptr;
+    local_tail = 0;
+    submitted_tail = 0;
+    buffer_memory = nullptr;
+    buffer_size = 0;
+    num_buffers = 0;
+}
+
+IoUring::~IoUring()
+{
+    teardown();
+}
+
+bool IoUring::init(unsigned entries, int num_buffers, size_t buffer_size)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+        return false;
+    sq_entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        teardown();
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cq_ring = sq_ring;
+    }
+    else
+    {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+            teardown();
+            return false;
+        }
+    }
+    void *sqes_ptr = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED)
+    {
+        teardown();
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+    char *sq = static_cast<char *>(sq_ring);
+    char *cq = static_cast<char *>(cq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    local_tail = submitted_tail = *sq_tail;
+
+    if (!probe_ops())
+    {
+        teardown();
+        return false;
+    }
+
+    this->buffer_size = buffer_size;
+    this->num_buffers = num_buffers;
+    void *memory = mmap(nullptr, buffer_size * num_buffers, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        teardown();
+        return false;
+    }
+    buffer_memory = static_cast<char *>(memory);
+    std::vector<iovec> iovs(num_buffers);
+    for (int i = 0; i < num_buffers; i++)
+    {
+        iovs[i].iov_base = buffer_memory + i * buffer_size;
+        iovs[i].iov_len = buffer_size;
+        free_buffers.push_back(num_buffers - 1 - i);
+    }
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iovs.data(), num_buffers) < 0)
+    {
+        teardown();
+        return false;
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+    {
+        teardown();
+        return false;
+    }
+    return true;
+}
+
+bool IoUring::probe_ops()
+{
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<char> storage(probe_size, 0);
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(storage.data());
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+    int needed[] = {IORING_OP_READ_FIXED, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL};
+    for (int op : needed)
+    {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    }
+    return true;
+}
+
+void IoUring::teardown()
+{
+    if (event_fd >= 0)
+        close(event_fd);
+    if (buffer_memory)
+        munmap(buffer_memory, buffer_size * num_buffers);
+    if (sqes)
+        munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+    event_fd = -1;
+    buffer_memory = nullptr;
+    sqes = nullptr;
+    cq_ring = MAP_FAILED;
+    sq_ring = MAP_FAILED;
+    ring_fd = -1;
+    free_buffers.clear();
+}
+
+int IoUring::get_event_fd() const
+{
+    return event_fd;
+}
+
+size_t IoUring::get_buffer_size() const
+{
+    return buffer_size;
+}
+
+char *IoUring::get_buffer(int index) const
+{
+    return buffer_memory + index * buffer_size;
+}
+
+int IoUring::acquire_buffer()
+{
+    if (free_buffers.empty())
+        return -1;
+    int index = free_buffers.back();
+    free_buffers.pop_back();
+    return index;
+}
+
+void IoUring::release_buffer(int index)
+{
+    free_buffers.push_back(index);
+}
+
+io_uring_sqe *IoUring::get_sqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (local_tail - head >= sq_entries)
+    {
+        submit();
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries)
+            return nullptr;
+    }
+    unsigned index = local_tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    local_tail++;
+    return sqe;
+}
+
+bool IoUring::prep_read_fixed(int fd, int buffer_index, size_t length, off_t offset, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(get_buffer(buffer_index));
+    sqe->len = std::min(length, buffer_size);
+    sqe->off = offset;
+    sqe->buf_index = buffer_index;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool IoUring::prep_send(int fd, const char *data, size_t length, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// Asks the kernel to cancel the request submitted with user_data target; the
+// cancelled request still completes, with -ECANCELED.
+bool IoUring::prep_cancel(uint64_t target, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    return true;
+}
+
+int IoUring::submit()
+{
+    unsigned to_submit = local_tail - submitted_tail;
+    if (to_submit == 0)
+        return 0;
+    __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+    int ret;
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0)
+        submitted_tail += ret;
+    return ret;
+}
+
+std::vector<IoUringCompletion> IoUring::reap()
+{
+    std::vector<IoUringCompletion> completions;
+    uint64_t counter;
+    while (read(event_fd, &counter, sizeof(counter)) > 0)
+    {
+    }
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        completions.push_back({cqe->user_data, cqe->res});
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return completions;
+}
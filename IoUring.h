@@ -0,0 +1,68 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+struct IoUringCompletion
+{
+    uint64_t user_data;
+    int result;
+};
+
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+    bool init(unsigned entries, int num_buffers, size_t buffer_size);
+    int get_event_fd() const;
+    size_t get_buffer_size() const;
+    char *get_buffer(int index) const;
+    int acquire_buffer();
+    void release_buffer(int index);
+    bool prep_read_fixed(int fd, int buffer_index, size_t length, off_t offset, uint64_t user_data);
+    bool prep_send(int fd, const char *data, size_t length, uint64_t user_data);
+    bool prep_cancel(uint64_t target, uint64_t user_data);
+    int submit();
+    std::vector<IoUringCompletion> reap();
+
+private:
+    int ring_fd;
+    int event_fd;
+    unsigned sq_entries;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    io_uring_sqe *sqes;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned local_tail;
+    unsigned submitted_tail;
+    char *buffer_memory;
+    size_t buffer_size;
+    int num_buffers;
+    std::vector<int> free_buffers;
+    io_uring_sqe *get_sqe();
+    bool probe_ops();
+    void teardown();
+};
+
+#endif
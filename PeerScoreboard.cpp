@@ -0,0 +1,178 @@
+#include "PeerScoreboard.h"
+
+static double blend(double current, double sample)
+{
+    return current > 0.0 ? current + PEER_SCORE_ALPHA * (sample - current) : sample;
+}
+
+PeerScoreboard::PeerScoreboard(const std::string &path)
+{
+    this->path = path;
+    dirty = false;
+    last_save = std::chrono::steady_clock::now();
+    load();
+}
+
+void PeerScoreboard::record_rtt(int port, double seconds)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    PeerScore &peer = score(port);
+    peer.rtt_seconds = blend(peer.rtt_seconds, seconds);
+    dirty = true;
+}
+
+// Short transfers are dominated by the first round trip, so only runs of at
+// least MIN_THROUGHPUT_SAMPLE_BYTES count towards sustained throughput.
+void PeerScoreboard::record_transfer(int port, uint64_t bytes, double seconds)
+{
+    if (bytes < MIN_THROUGHPUT_SAMPLE_BYTES || seconds <= 0.0)
+        return;
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    PeerScore &peer = score(port);
+    peer.throughput = blend(peer.throughput, bytes / seconds);
+    dirty = true;
+}
+
+void PeerScoreboard::record_capacity(int port, uint64_t bytes_per_second)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    PeerScore &peer = score(port);
+    if (peer.capacity != bytes_per_second)
+        dirty = true;
+    peer.capacity = bytes_per_second;
+}
+
+void PeerScoreboard::record_success(int port)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    PeerScore &peer = score(port);
+    peer.successes++;
+    peer.failure_score *= PEER_FAILURE_DECAY;
+    dirty = true;
+}
+
+void PeerScoreboard::record_failure(int port)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    PeerScore &peer = score(port);
+    peer.failures++;
+    peer.failure_score += 1.0;
+    dirty = true;
+}
+
+double PeerScoreboard::expected_throughput(int port)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    return expected_locked(port);
+}
+
+std::vector<double> PeerScoreboard::weights(const std::vector<int> &ports)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    std::vector<double> result;
+    for (int port : ports)
+        result.push_back(expected_locked(port));
+    return result;
+}
+
+// Fastest expected peer first; lower RTT breaks ties between peers that have
+// never been measured.
+void PeerScoreboard::rank(std::vector<int> &ports)
+{
+    std::lock_guard<std::mutex> lock(scoreboard_mutex);
+    std::map<int, std::pair<double, double>> keys;
+    for (int port : ports)
+    {
+        double rtt = scores.count(port) ? scores[port].rtt_seconds : 0.0;
+        keys[port] = {expected_locked(port), rtt > 0.0 ? rtt : 1.0};
+    }
+    std::stable_sort(ports.begin(), ports.end(), [&](int a, int b)
+                     { return keys[a].first != keys[b].first ? keys[a].first > keys[b].first : keys[a].second < keys[b].second; });
+}
+
+// Writes through a temporary file and rename so a crash never leaves a torn
+// scoreboard. Without force, saves at most every PEER_SCORES_SAVE_SECONDS.
+// The scores are formatted under the lock and written outside it, so
+// transfers recording samples never wait on the file.
+void PeerScoreboard::save(bool force)
+{
+    std::lock_guard<std::mutex> save_lock(save_mutex);
+    auto now = std::chrono::steady_clock::now();
+    std::ostringstream text;
+    {
+        std::lock_guard<std::mutex> lock(scoreboard_mutex);
+        if (!dirty || (!force && std::chrono::duration<double>(now - last_save).count() < PEER_SCORES_SAVE_SECONDS))
+            return;
+        text << "peer-scores 1\n";
+        for (const auto &entry : scores)
+        {
+            const PeerScore &peer = entry.second;
+            text << entry.first << " " << peer.rtt_seconds << " " << peer.throughput << " " << peer.capacity << " "
+                 << peer.failure_score << " " << peer.successes << " " << peer.failures << "\n";
+        }
+        dirty = false;
+        last_save = now;
+    }
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << text.str();
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        std::lock_guard<std::mutex> lock(scoreboard_mutex);
+        dirty = true;
+    }
+}
+
+PeerScoreboard::PeerScore &PeerScoreboard::score(int port)
+{
+    auto it = scores.find(port);
+    if (it == scores.end())
+        it = scores.emplace(port, PeerScore{0.0, 0.0, 0, 0.0, 0, 0}).first;
+    return it->second;
+}
+
+// Measured throughput wins over the advertised capacity; a peer with neither
+// is assumed to be as fast as the measured average, so new seeders get a
+// fair first share. Failures then divide the estimate down.
+double PeerScoreboard::expected_locked(int port)
+{
+    auto it = scores.find(port);
+    double estimate = 0.0;
+    if (it != scores.end())
+        estimate = it->second.throughput > 0.0 ? it->second.throughput : (double)it->second.capacity;
+    if (estimate <= 0.0)
+    {
+        double sum = 0.0;
+        int measured = 0;
+        for (const auto &entry : scores)
+        {
+            if (entry.second.throughput > 0.0)
+            {
+                sum += entry.second.throughput;
+                measured++;
+            }
+        }
+        estimate = measured > 0 ? sum / measured : DEFAULT_PEER_THROUGHPUT;
+    }
+    if (it != scores.end())
+        estimate /= 1.0 + it->second.failure_score;
+    return estimate;
+}
+
+void PeerScoreboard::load()
+{
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line) || line != "peer-scores 1")
+        return;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        int port;
+        PeerScore peer;
+        if (fields >> port >> peer.rtt_seconds >> peer.throughput >> peer.capacity >> peer.failure_score >> peer.successes >> peer.failures)
+            scores[port] = peer;
+    }
+}
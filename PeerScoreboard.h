@@ -0,0 +1,61 @@
+#ifndef PEER_SCOREBOARD_H
+#define PEER_SCOREBOARD_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+const std::string PEER_SCORES_FILE = ".peer_scores";
+const double PEER_SCORE_ALPHA = 0.3;
+const double DEFAULT_PEER_THROUGHPUT = 8.0 * 1024 * 1024;
+const uint64_t MIN_THROUGHPUT_SAMPLE_BYTES = 1024 * 1024;
+const double PEER_FAILURE_DECAY = 0.5;
+const double PEER_SCORES_SAVE_SECONDS = 5.0;
+
+// Per-seeder history of round-trip time, sustained throughput and
+// reliability, kept across runs in a small text file. Peers are ranked and
+// work is split by expected throughput; repeated failures shrink a peer's
+// weight until it starts succeeding again.
+class PeerScoreboard
+{
+public:
+    explicit PeerScoreboard(const std::string &path);
+    void record_rtt(int port, double seconds);
+    void record_transfer(int port, uint64_t bytes, double seconds);
+    void record_capacity(int port, uint64_t bytes_per_second);
+    void record_success(int port);
+    void record_failure(int port);
+    double expected_throughput(int port);
+    std::vector<double> weights(const std::vector<int> &ports);
+    void rank(std::vector<int> &ports);
+    void save(bool force);
+
+private:
+    struct PeerScore
+    {
+        double rtt_seconds;
+        double throughput;
+        uint64_t capacity;
+        double failure_score;
+        uint64_t successes;
+        uint64_t failures;
+    };
+    std::string path;
+    std::mutex scoreboard_mutex;
+    std::mutex save_mutex;
+    std::map<int, PeerScore> scores;
+    bool dirty;
+    std::chrono::steady_clock::time_point last_save;
+    PeerScore &score(int port);
+    double expected_locked(int port);
+    void load();
+};
+
+#endif
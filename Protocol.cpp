@@ -0,0 +1,333 @@
+#include "Protocol.h"
+
+static void put_u16(char *out, uint16_t value)
+{
+    out[0] = value & 0xff;
+    out[1] = (value >> 8) & 0xff;
+}
+
+static void put_u32(char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static void put_u64(char *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint16_t get_u16(const char *in)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(in);
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const char *in)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(in);
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static uint64_t get_u64(const char *in)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(in);
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+FrameHeader make_header(uint8_t opcode, uint32_t request_id, uint32_t file_id, uint64_t offset, uint64_t length)
+{
+    FrameHeader header;
+    header.opcode = opcode;
+    header.flags = 0;
+    header.version = PROTOCOL_VERSION;
+    header.request_id = request_id;
+    header.file_id = file_id;
+    header.payload_length = 0;
+    header.offset = offset;
+    header.length = length;
+    return header;
+}
+
+void encode_header(const FrameHeader &header, char *out)
+{
+    out[0] = header.opcode;
+    out[1] = header.flags;
+    put_u16(out + 2, header.version);
+    put_u32(out + 4, header.request_id);
+    put_u32(out + 8, header.file_id);
+    put_u32(out + 12, header.payload_length);
+    put_u64(out + 16, header.offset);
+    put_u64(out + 24, header.length);
+}
+
+void decode_header(const char *in, FrameHeader &header)
+{
+    header.opcode = in[0];
+    header.flags = in[1];
+    header.version = get_u16(in + 2);
+    header.request_id = get_u32(in + 4);
+    header.file_id = get_u32(in + 8);
+    header.payload_length = get_u32(in + 12);
+    header.offset = get_u64(in + 16);
+    header.length = get_u64(in + 24);
+}
+
+std::string encode_frame(FrameHeader header, const std::string &payload)
+{
+    header.payload_length = payload.size();
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    encode_header(header, &frame[0]);
+    frame += payload;
+    return frame;
+}
+
+// Catalog entries: u32 file_id, u64 size, u16 name length, name bytes.
+std::string encode_catalog(const std::map<int, FileInfo> &catalog)
+{
+    std::string payload;
+    for (const auto &entry : catalog)
+    {
+        char fixed[14];
+        put_u32(fixed, entry.first);
+        put_u64(fixed + 4, entry.second.size);
+        put_u16(fixed + 12, entry.second.filename.size());
+        payload.append(fixed, sizeof(fixed));
+        payload += entry.second.filename;
+    }
+    return payload;
+}
+
+bool decode_catalog(const char *data, size_t length, std::map<int, FileInfo> &catalog)
+{
+    size_t pos = 0;
+    while (pos < length)
+    {
+        if (length - pos < 14)
+            return false;
+        int file_id = get_u32(data + pos);
+        long size = get_u64(data + pos + 4);
+        size_t name_length = get_u16(data + pos + 12);
+        pos += 14;
+        if (length - pos < name_length)
+            return false;
+        catalog[file_id] = {std::string(data + pos, name_length), size};
+        pos += name_length;
+    }
+    return true;
+}
+
+// Range list: u32 count, then count pairs of u64 offset, u64 length.
+std::string encode_ranges(const std::vector<ByteRange> &ranges)
+{
+    std::string payload(4 + ranges.size() * 16, '\0');
+    put_u32(&payload[0], ranges.size());
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        put_u64(&payload[4 + i * 16], ranges[i].offset);
+        put_u64(&payload[12 + i * 16], ranges[i].length);
+    }
+    return payload;
+}
+
+bool decode_ranges(const char *data, size_t length, std::vector<ByteRange> &ranges)
+{
+    if (length < 4)
+        return false;
+    size_t count = get_u32(data);
+    if (length != 4 + count * 16)
+        return false;
+    ranges.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        ranges[i].offset = get_u64(data + 4 + i * 16);
+        ranges[i].length = get_u64(data + 12 + i * 16);
+    }
+    return true;
+}
+
+bool PieceAvailability::covers(const ByteRange &range) const
+{
+    if (complete)
+        return true;
+    if (piece_size == 0 || range.length == 0)
+        return false;
+    for (uint64_t piece = range.offset / piece_size; piece <= (range.offset + range.length - 1) / piece_size; piece++)
+    {
+        if (piece / 8 >= bitmap.size() || !(bitmap[piece / 8] & (1 << (piece % 8))))
+            return false;
+    }
+    return true;
+}
+
+// Drops every piece the range touches, spelling out a complete file's
+// pieces first so the rest stay held.
+void PieceAvailability::remove(const ByteRange &range, uint64_t total_size)
+{
+    if (range.length == 0 || piece_size == 0)
+        return;
+    if (complete)
+    {
+        complete = false;
+        uint64_t pieces = (total_size + piece_size - 1) / piece_size;
+        bitmap.assign((pieces + 7) / 8, 0);
+        for (uint64_t piece = 0; piece < pieces; piece++)
+            bitmap[piece / 8] |= 1 << (piece % 8);
+    }
+    for (uint64_t piece = range.offset / piece_size; piece <= (range.offset + range.length - 1) / piece_size; piece++)
+    {
+        if (piece / 8 < bitmap.size())
+            bitmap[piece / 8] &= ~(1 << (piece % 8));
+    }
+}
+
+PieceAvailability decode_availability(const FrameHeader &header, const char *payload)
+{
+    PieceAvailability availability;
+    availability.complete = header.length == 0;
+    availability.piece_size = header.length;
+    availability.bitmap.assign(payload, payload + header.payload_length);
+    availability.source_version = header.offset;
+    return availability;
+}
+
+bool send_all(int sock, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+bool read_frame(int sock, FrameDecoder &decoder, Frame &frame)
+{
+    char buffer[64 * 1024];
+    while (!decoder.next(frame))
+    {
+        if (decoder.has_error())
+            return false;
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        decoder.feed(buffer, n);
+    }
+    return true;
+}
+
+// Streaming counterpart of read_frame: returns only the header and leaves the
+// payload on the socket, to be pulled with read_payload straight into the
+// caller's memory. The payload must be read before the next header.
+bool read_frame_header(int sock, FrameDecoder &decoder, FrameHeader &header)
+{
+    char buffer[FRAME_HEADER_SIZE];
+    while (!decoder.next_header(header))
+    {
+        if (decoder.has_error())
+            return false;
+        ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        decoder.feed(buffer, n);
+    }
+    return true;
+}
+
+bool read_payload(int sock, FrameDecoder &decoder, char *destination, size_t length)
+{
+    size_t received = decoder.take(destination, length);
+    while (received < length)
+    {
+        ssize_t n = recv(sock, destination + received, length - received, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        received += n;
+    }
+    return true;
+}
+
+FrameDecoder::FrameDecoder()
+{
+    consumed = 0;
+    error = false;
+}
+
+void FrameDecoder::feed(const char *data, size_t length)
+{
+    if (consumed > 0 && consumed == buffer.size())
+    {
+        buffer.clear();
+        consumed = 0;
+    }
+    else if (consumed > 64 * 1024)
+    {
+        buffer.erase(0, consumed);
+        consumed = 0;
+    }
+    buffer.append(data, length);
+}
+
+bool FrameDecoder::next(Frame &frame)
+{
+    if (error || buffer.size() - consumed < FRAME_HEADER_SIZE)
+        return false;
+    decode_header(buffer.data() + consumed, frame.header);
+    if (frame.header.payload_length > MAX_FRAME_PAYLOAD)
+    {
+        error = true;
+        return false;
+    }
+    if (buffer.size() - consumed < FRAME_HEADER_SIZE + frame.header.payload_length)
+        return false;
+    frame.payload = buffer.data() + consumed + FRAME_HEADER_SIZE;
+    consumed += FRAME_HEADER_SIZE + frame.header.payload_length;
+    return true;
+}
+
+bool FrameDecoder::next_header(FrameHeader &header)
+{
+    if (error || buffer.size() - consumed < FRAME_HEADER_SIZE)
+        return false;
+    decode_header(buffer.data() + consumed, header);
+    if (header.payload_length > MAX_FRAME_PAYLOAD)
+    {
+        error = true;
+        return false;
+    }
+    consumed += FRAME_HEADER_SIZE;
+    return true;
+}
+
+size_t FrameDecoder::take(char *destination, size_t length)
+{
+    size_t available = std::min(length, buffer.size() - consumed);
+    memcpy(destination, buffer.data() + consumed, available);
+    consumed += available;
+    return available;
+}
+
+bool FrameDecoder::has_error() const
+{
+    return error;
+}
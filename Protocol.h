@@ -0,0 +1,147 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+const uint16_t PROTOCOL_VERSION = 1;
+const uint16_t PROTOCOL_MIN_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 32;
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024 * 1024;
+const uint64_t MAX_CHUNK_SIZE = 8 * 1024 * 1024;
+const size_t MAX_RANGES_PER_REQUEST = 256;
+
+enum Opcode
+{
+    OP_HELLO = 1,
+    OP_HELLO_ACK = 2,
+    OP_LIST = 3,
+    OP_LIST_RESPONSE = 4,
+    OP_DOWNLOAD = 5,
+    OP_DATA = 6,
+    OP_STATS = 7,
+    OP_STATS_RESPONSE = 8,
+    OP_ERROR = 9,
+    OP_DOWNLOAD_RANGES = 10,
+    OP_CANCEL = 11,
+    OP_AVAILABILITY = 12,
+    OP_AVAILABILITY_RESPONSE = 13
+};
+
+enum FrameFlags
+{
+    FLAG_CANCELLED = 1,
+    FLAG_UNAVAILABLE = 2
+};
+
+// OP_HELLO carries the sender's highest version in version, its lowest in
+// offset and the largest chunk it wants in length; OP_HELLO_ACK echoes the
+// version and chunk size limit the server picked.
+// OP_LIST_RESPONSE carries the seeder's advertised upload capacity in bytes
+// per second in length, or 0 when it does not advertise one.
+// OP_DOWNLOAD_RANGES carries a range list payload and is answered with one
+// OP_DATA frame per range, in order, all tagged with the request id; a list
+// of more than MAX_RANGES_PER_REQUEST ranges is refused with ERR_BAD_REQUEST.
+// OP_CANCEL names a request id and range offset; if that range has not
+// started sending it is answered by an empty OP_DATA with FLAG_CANCELLED.
+// OP_AVAILABILITY names a file; the response carries the piece size in
+// length and a bitfield payload (bit i of byte i / 8 set when piece i is
+// held), or a zero piece size when the whole file is held, and the source
+// version in offset: the file's mtime in nanoseconds, or for a partial file
+// the version it is being downloaded from (0 if unknown). A range that
+// touches a piece the seeder lacks is answered by an empty OP_DATA with
+// FLAG_UNAVAILABLE.
+// OP_ERROR frames carry the ErrorCode in the offset field.
+enum ErrorCode
+{
+    ERR_BAD_VERSION = 1,
+    ERR_NOT_FOUND = 2,
+    ERR_BAD_REQUEST = 3
+};
+
+// Wire layout, little-endian:
+// u8 opcode, u8 flags, u16 version, u32 request_id, u32 file_id,
+// u32 payload_length, u64 offset, u64 length.
+struct FrameHeader
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t version;
+    uint32_t request_id;
+    uint32_t file_id;
+    uint32_t payload_length;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// payload points into the decoder's buffer and is only valid until the next feed().
+struct Frame
+{
+    FrameHeader header;
+    const char *payload;
+};
+
+struct ByteRange
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Which fixed-size pieces of a file a peer holds.
+struct PieceAvailability
+{
+    bool complete;
+    uint64_t piece_size;
+    std::vector<uint8_t> bitmap;
+    uint64_t source_version;
+    bool covers(const ByteRange &range) const;
+    void remove(const ByteRange &range, uint64_t total_size);
+};
+
+struct FileInfo
+{
+    std::string filename;
+    long size;
+};
+
+FrameHeader make_header(uint8_t opcode, uint32_t request_id = 0, uint32_t file_id = 0, uint64_t offset = 0, uint64_t length = 0);
+void encode_header(const FrameHeader &header, char *out);
+void decode_header(const char *in, FrameHeader &header);
+std::string encode_frame(FrameHeader header, const std::string &payload = std::string());
+std::string encode_catalog(const std::map<int, FileInfo> &catalog);
+bool decode_catalog(const char *data, size_t length, std::map<int, FileInfo> &catalog);
+std::string encode_ranges(const std::vector<ByteRange> &ranges);
+bool decode_ranges(const char *data, size_t length, std::vector<ByteRange> &ranges);
+PieceAvailability decode_availability(const FrameHeader &header, const char *payload);
+
+class FrameDecoder;
+
+bool send_all(int sock, const std::string &data);
+bool read_frame(int sock, FrameDecoder &decoder, Frame &frame);
+bool read_frame_header(int sock, FrameDecoder &decoder, FrameHeader &header);
+bool read_payload(int sock, FrameDecoder &decoder, char *destination, size_t length);
+
+class FrameDecoder
+{
+public:
+    FrameDecoder();
+    void feed(const char *data, size_t length);
+    bool next(Frame &frame);
+    bool next_header(FrameHeader &header);
+    size_t take(char *destination, size_t length);
+    bool has_error() const;
+
+private:
+    std::string buffer;
+    size_t consumed;
+    bool error;
+};
+
+#endif
@@ -1,15 +1,47 @@
 #include "Server.h"
 #include "Client.h"
 
-int main()
+static void print_usage(const char *program)
 {
+    std::cerr << "Usage: " << program << " [--receive-mode write|mmap] [--upload-capacity bytes_per_second]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    ReceiveMode receive_mode = RECEIVE_MODE_WRITE;
+    uint64_t upload_capacity = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--receive-mode" && (value == "write" || value == "mmap"))
+        {
+            receive_mode = value == "mmap" ? RECEIVE_MODE_MMAP : RECEIVE_MODE_WRITE;
+            i++;
+        }
+        else if (arg == "--upload-capacity" && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos)
+        {
+            upload_capacity = strtoull(value.c_str(), nullptr, 10);
+            i++;
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
     std::vector<int> ports = {8999, 9000, 9002, 9003, 9004};
     std::string directory_path = "./files";
     std::cout << "Finding available ports...";
-    Server server(directory_path, ports);
+    int num_shards = std::max(1u, std::thread::hardware_concurrency());
+    Server server(directory_path, ports, SOMAXCONN, num_shards);
+    server.set_io_backend(IO_BACKEND_URING);
+    server.set_chunk_cache(64 * 1024 * 1024, true);
+    server.set_upload_capacity(upload_capacity);
     server.start();
     int listen_port = server.get_listen_port();
     Client client(ports, listen_port, directory_path);
+    client.set_receive_mode(receive_mode);
     client.run();
     return 0;
 }
@@ -1,11 +1,41 @@
 #include "Server.h"
 
-Server::Server(const std::string &dir, const std::vector<int> &ports)
+Server::Server(const std::string &dir, const std::vector<int> &ports, int backlog, int num_shards)
+    : file_cache(dir, 256)
 {
     directory_path = dir;
     this->ports = ports;
-    listen_fd = -1;
+    this->backlog = backlog;
+    this->num_shards = std::max(1, num_shards);
+    io_backend = IO_BACKEND_SENDFILE;
     listen_port = -1;
+    inotify_fd = -1;
+    root_watch = -1;
+    chunk_cache_budget = 0;
+    chunk_cache_huge_pages = false;
+    upload_capacity = 0;
+}
+
+void Server::set_io_backend(IoBackend backend)
+{
+    io_backend = backend;
+}
+
+void Server::set_chunk_cache(size_t budget_bytes, bool huge_pages)
+{
+    chunk_cache_budget = budget_bytes;
+    chunk_cache_huge_pages = huge_pages;
+}
+
+// Advertised to clients in every catalog response; 0 advertises nothing.
+void Server::set_upload_capacity(uint64_t bytes_per_second)
+{
+    upload_capacity = bytes_per_second;
+}
+
+ChunkCacheStats Server::get_chunk_cache_stats()
+{
+    return chunk_cache.get_stats();
 }
 
 void Server::start()
@@ -17,8 +47,39 @@ void Server::start()
     }
     std::cout << "Found port " << listen_port << "\n";
     std::cout << "Listening at port " << listen_port << "\n";
-    pthread_t accept_thread_id;
-    pthread_create(&accept_thread_id, nullptr, accept_thread_helper, this);
+    build_catalog();
+    if (chunk_cache_budget > 0 && !chunk_cache.init(chunk_cache_budget, 64 * 1024, chunk_cache_huge_pages))
+        std::cerr << "Failed to allocate chunk cache, serving from disk\n";
+    int num_cpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    for (Shard &shard : shards)
+    {
+        shard.cpu = shard.index % num_cpus;
+        shard.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (shard.epoll_fd < 0)
+        {
+            perror("epoll_create1 failed");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = shard.listen_fd;
+        if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, shard.listen_fd, &ev) < 0)
+        {
+            perror("epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+        setup_ring(shard);
+        pthread_t event_loop_thread_id;
+        pthread_create(&event_loop_thread_id, nullptr, event_loop_thread_helper, new ShardArgs{&shard, this});
+        if (shards.size() > 1)
+        {
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(shard.cpu, &cpu_set);
+            pthread_setaffinity_np(event_loop_thread_id, sizeof(cpu_set), &cpu_set);
+        }
+        pthread_detach(event_loop_thread_id);
+    }
 }
 
 int Server::get_listen_port() const
@@ -36,129 +97,609 @@ std::string Server::get_directory_path() const
     return directory_path;
 }
 
-void *Server::accept_thread_helper(void *arg)
+void *Server::event_loop_thread_helper(void *arg)
 {
-    return static_cast<Server *>(arg)->accept_thread();
+    ShardArgs *args = static_cast<ShardArgs *>(arg);
+    void *ret = args->server_ptr->event_loop_thread(args->shard_ptr);
+    delete args;
+    return ret;
 }
 
-void *Server::accept_thread()
+void *Server::event_loop_thread(Shard *shard)
 {
-    struct sockaddr_in addr{};
-    socklen_t addrlen = sizeof(addr);
+    struct epoll_event events[64];
     while (1)
     {
-        int *client_socket = new int(accept(listen_fd, (struct sockaddr *)&addr, &addrlen));
-        if (*client_socket < 0)
+        int n = epoll_wait(shard->epoll_fd, events, 64, -1);
+        if (n < 0)
         {
-            perror("Accept failed");
-            continue;
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
         }
-        else
+        for (int i = 0; i < n; i++)
         {
-            pthread_t handler;
-            pthread_create(&handler, nullptr, handle_client_thread_helper, new AcceptArgs{client_socket, this});
-            pthread_detach(handler);
+            int fd = events[i].data.fd;
+            if (fd == shard->listen_fd)
+            {
+                accept_connections(*shard);
+                continue;
+            }
+            if (shard->ring && fd == shard->ring->get_event_fd())
+            {
+                handle_ring_completions(*shard);
+                continue;
+            }
+            auto it = shard->connections.find(fd);
+            if (it == shard->connections.end())
+                continue;
+            Connection &conn = it->second;
+            bool keep_open = !(events[i].events & (EPOLLERR | EPOLLHUP));
+            if (keep_open && (events[i].events & EPOLLIN))
+                keep_open = handle_readable(conn);
+            if (keep_open)
+                keep_open = flush_connection(*shard, conn);
+            if (!keep_open)
+            {
+                close_connection(*shard, fd);
+                continue;
+            }
+            update_write_interest(*shard, conn);
         }
+        if (shard->ring)
+            shard->ring->submit();
     }
     return nullptr;
 }
 
-void *Server::handle_client_thread_helper(void *arg)
+void Server::accept_connections(Shard &shard)
 {
-    AcceptArgs *args = static_cast<AcceptArgs *>(arg);
-    void *ret = args->server_ptr->handle_client_thread(args->fd_ptr);
-    delete args;
-    return ret;
+    while (1)
+    {
+        struct sockaddr_in addr{};
+        socklen_t addrlen = sizeof(addr);
+        int client_fd = accept4(shard.listen_fd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Accept failed");
+            return;
+        }
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = client_fd;
+        if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+        {
+            perror("epoll_ctl failed");
+            close(client_fd);
+            continue;
+        }
+        int opt = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        Connection &conn = shard.connections[client_fd];
+        conn.fd = client_fd;
+        conn.version = 0;
+        conn.max_chunk_size = MAX_CHUNK_SIZE;
+        conn.want_write = false;
+        conn.ring_op = 0;
+        conn.ring_buffer = -1;
+    }
 }
 
-void *Server::handle_client_thread(int *client_fd_ptr)
+bool Server::handle_readable(Connection &conn)
 {
-    int client_fd = *client_fd_ptr;
-    delete client_fd_ptr;
-
+    char buffer[4096];
     while (1)
     {
-        char buffer[1024];
-        ssize_t bytes = recv(client_fd, buffer, sizeof(buffer), 0);
-        if (bytes <= 0)
+        ssize_t bytes = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (bytes == 0)
+            return false;
+        if (bytes < 0)
         {
-            close(client_fd);
-            return nullptr;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
         }
-        buffer[bytes] = '\0';
-        std::string request(buffer);
-        if (request == "LIST")
+        conn.decoder.feed(buffer, bytes);
+    }
+    Frame frame;
+    while (conn.decoder.next(frame))
+    {
+        if (!handle_request(conn, frame))
+            return false;
+    }
+    return !conn.decoder.has_error();
+}
+
+bool Server::handle_request(Connection &conn, const Frame &frame)
+{
+    const FrameHeader &header = frame.header;
+    if (header.opcode == OP_HELLO)
+    {
+        uint16_t version = std::min(header.version, PROTOCOL_VERSION);
+        if (version < std::max<uint64_t>(header.offset, PROTOCOL_MIN_VERSION))
         {
-            auto files = list_files();
-            std::string response;
-            for (auto &f : files)
-            {
-                response += "[" + std::to_string(f.first) + "] " + f.second.filename + " - " + std::to_string(f.second.size) + " bytes\n";
-            }
-            send(client_fd, response.c_str(), response.size(), 0);
+            queue_frame(conn, make_header(OP_ERROR, header.request_id, 0, ERR_BAD_VERSION));
+            return true;
+        }
+        conn.version = version;
+        conn.max_chunk_size = header.length > 0 ? std::min(header.length, MAX_CHUNK_SIZE) : MAX_CHUNK_SIZE;
+        FrameHeader ack = make_header(OP_HELLO_ACK, header.request_id, 0, 0, conn.max_chunk_size);
+        ack.version = version;
+        queue_frame(conn, ack);
+    }
+    else if (conn.version == 0)
+    {
+        queue_frame(conn, make_header(OP_ERROR, header.request_id, 0, ERR_BAD_VERSION));
+    }
+    else if (header.opcode == OP_LIST)
+    {
+        queue_frame(conn, make_header(OP_LIST_RESPONSE, header.request_id, 0, 0, upload_capacity), *get_catalog_response());
+    }
+    else if (header.opcode == OP_STATS)
+    {
+        ChunkCacheStats stats = get_chunk_cache_stats();
+        std::string response = "hits " + std::to_string(stats.hits) + " misses " + std::to_string(stats.misses) + " evictions " + std::to_string(stats.evictions) + " used " + std::to_string(stats.used_bytes) + " budget " + std::to_string(stats.budget_bytes) + (stats.huge_pages ? " hugepages" : "") + "\n";
+        queue_frame(conn, make_header(OP_STATS_RESPONSE, header.request_id), response);
+    }
+    else if (header.opcode == OP_AVAILABILITY)
+    {
+        std::shared_ptr<CachedFile> file = file_cache.get(header.file_id);
+        std::shared_ptr<const PieceAvailability> pieces = file ? get_availability(*file) : nullptr;
+        if (!pieces)
+            queue_frame(conn, make_header(OP_ERROR, header.request_id, header.file_id, ERR_NOT_FOUND));
+        else
+        {
+            uint64_t version = pieces->complete ? (uint64_t)file->mtime.tv_sec * 1000000000 + file->mtime.tv_nsec : pieces->source_version;
+            queue_frame(conn, make_header(OP_AVAILABILITY_RESPONSE, header.request_id, header.file_id, version, pieces->complete ? 0 : pieces->piece_size),
+                        std::string(pieces->bitmap.begin(), pieces->bitmap.end()));
         }
-        else if (request.find("DOWNLOAD ") != std::string::npos)
+    }
+    else if (header.opcode == OP_DOWNLOAD)
+    {
+        std::shared_ptr<CachedFile> file = file_cache.get(header.file_id);
+        if (!file)
+            queue_frame(conn, make_header(OP_ERROR, header.request_id, header.file_id, ERR_NOT_FOUND));
+        else
+            queue_file_range(conn, header.request_id, file, get_availability(*file), header.offset, header.length);
+    }
+    else if (header.opcode == OP_CANCEL)
+    {
+        cancel_range(conn, header.request_id, header.offset);
+    }
+    else if (header.opcode == OP_DOWNLOAD_RANGES)
+    {
+        std::vector<ByteRange> ranges;
+        std::shared_ptr<CachedFile> file;
+        if (!decode_ranges(frame.payload, header.payload_length, ranges) || ranges.size() > MAX_RANGES_PER_REQUEST)
+            queue_frame(conn, make_header(OP_ERROR, header.request_id, header.file_id, ERR_BAD_REQUEST));
+        else if (!(file = file_cache.get(header.file_id)))
+            queue_frame(conn, make_header(OP_ERROR, header.request_id, header.file_id, ERR_NOT_FOUND));
+        else
         {
-            std::istringstream iss(request);
-            std::string cmd;
-            int file_id;
-            long start_byte, chunk_size;
-            iss >> cmd >> file_id >> start_byte >> chunk_size;
-            std::string file_dir = directory_path + "/" + std::to_string(file_id);
-            DIR *dir = opendir(file_dir.c_str());
-            std::string file_path;
+            // One availability snapshot serves the whole list.
+            std::shared_ptr<const PieceAvailability> pieces = get_availability(*file);
+            for (const ByteRange &range : ranges)
+                queue_file_range(conn, header.request_id, file, pieces, range.offset, range.length);
+        }
+    }
+    else
+    {
+        queue_frame(conn, make_header(OP_ERROR, header.request_id, header.file_id, ERR_BAD_REQUEST));
+    }
+    return true;
+}
+
+void Server::queue_frame(Connection &conn, const FrameHeader &header, const std::string &payload)
+{
+    conn.out_queue.push_back({encode_frame(header, payload)});
+}
+
+void Server::queue_file_range(Connection &conn, uint32_t request_id, const std::shared_ptr<CachedFile> &file,
+                              const std::shared_ptr<const PieceAvailability> &pieces, off_t start_byte, long chunk_size)
+{
+    int file_id = file->file_id;
+    if (start_byte < 0 || start_byte >= file->size || chunk_size <= 0)
+        chunk_size = 0;
+    else
+        chunk_size = std::min<long>(std::min<long>(chunk_size, conn.max_chunk_size), file->size - start_byte);
+    if (chunk_size > 0 && (!pieces || !pieces->covers({(uint64_t)start_byte, (uint64_t)chunk_size})))
+    {
+        FrameHeader unavailable = make_header(OP_DATA, request_id, file_id, start_byte, 0);
+        unavailable.flags = FLAG_UNAVAILABLE;
+        conn.out_queue.push_back({encode_frame(unavailable)});
+        conn.out_queue.back().is_range = true;
+        conn.out_queue.back().request_id = request_id;
+        conn.out_queue.back().range_offset = start_byte;
+        return;
+    }
+    FrameHeader data = make_header(OP_DATA, request_id, file_id, start_byte, chunk_size);
+    data.payload_length = chunk_size;
+    std::string data_header(FRAME_HEADER_SIZE, '\0');
+    encode_header(data, &data_header[0]);
+    size_t first_item = conn.out_queue.size();
+    conn.out_queue.push_back({data_header});
+    // Files still being written are always read through the page cache: a
+    // cached block could predate pieces that have arrived since.
+    if (chunk_size > 0)
+        conn.out_queue.push_back({std::string(), 0, file, start_byte, chunk_size, !file->partial});
+    for (size_t i = first_item; i < conn.out_queue.size(); i++)
+    {
+        conn.out_queue[i].is_range = true;
+        conn.out_queue[i].request_id = request_id;
+        conn.out_queue[i].range_offset = data.offset;
+    }
+}
+
+void Server::cancel_range(Connection &conn, uint32_t request_id, uint64_t range_offset)
+{
+    for (auto it = conn.out_queue.begin(); it != conn.out_queue.end(); ++it)
+    {
+        if (!it->is_range || it->request_id != request_id || it->range_offset != range_offset)
+            continue;
+        if (it->buffer_offset > 0 || it->file)
+            return;
+        auto end = it;
+        while (end != conn.out_queue.end() && end->is_range && end->request_id == request_id && end->range_offset == range_offset)
+            ++end;
+        it = conn.out_queue.erase(it, end);
+        FrameHeader header = make_header(OP_DATA, request_id, 0, range_offset, 0);
+        header.flags = FLAG_CANCELLED;
+        OutgoingData cancelled{encode_frame(header)};
+        conn.out_queue.insert(it, cancelled);
+        return;
+    }
+}
 
-            if (dir == NULL)
+static size_t pending_bytes(const OutgoingData &out)
+{
+    return out.buffer.size() - out.buffer_offset;
+}
+
+bool Server::flush_connection(Shard &shard, Connection &conn)
+{
+    while (!conn.out_queue.empty())
+    {
+        OutgoingData &out = conn.out_queue.front();
+        if (!out.file)
+        {
+            struct iovec iov[64];
+            size_t iov_count = 0;
+            for (auto it = conn.out_queue.begin(); it != conn.out_queue.end() && iov_count < 64 && !it->file; ++it)
             {
-                perror("Error opening directory");
-                break;
+                iov[iov_count].iov_base = &it->buffer[it->buffer_offset];
+                iov[iov_count].iov_len = pending_bytes(*it);
+                iov_count++;
             }
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL)
+            struct msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            int flags = MSG_NOSIGNAL | (conn.out_queue.size() > iov_count ? MSG_MORE : 0);
+            ssize_t sent = sendmsg(conn.fd, &msg, flags);
+            if (sent < 0)
             {
-                std::string name = entry->d_name;
-                if (name == "." || name == "..")
+                if (errno == EINTR)
                     continue;
-                if (entry->d_type == DT_REG)
-                {
-                    file_path = file_dir + "/" + name;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+                return false;
+            }
+            while (!conn.out_queue.empty() && !conn.out_queue.front().file)
+            {
+                OutgoingData &front = conn.out_queue.front();
+                size_t taken = std::min<size_t>(sent, pending_bytes(front));
+                front.buffer_offset += taken;
+                sent -= taken;
+                if (pending_bytes(front) > 0)
                     break;
+                conn.out_queue.pop_front();
+            }
+            continue;
+        }
+        else
+        {
+            if (conn.ring_op != 0)
+                return true;
+            if (conn.ring_buffer >= 0)
+                return submit_ring_send(shard, conn);
+            if (out.file_remaining > 0)
+            {
+                // Cached blocks are sent from memory; anything else goes out
+                // via io_uring or sendfile, one cache block at a time so the
+                // next block gets its own lookup.
+                long span = out.file_remaining;
+                if (out.buffered)
+                {
+                    if (!flush_file_range_buffered(conn, out, 0))
+                        return false;
+                    if (out.file_remaining > 0)
+                        return true;
+                    continue;
                 }
+                if (out.cacheable && chunk_cache.enabled())
+                {
+                    CachedSendResult result = flush_cached_block(conn, out);
+                    if (result == CACHED_FAILED)
+                        return false;
+                    if (result == CACHED_BLOCKED)
+                        return true;
+                    if (result == CACHED_SENT)
+                        continue;
+                    long block_size = chunk_cache.get_block_size();
+                    span = std::min<long>(span, block_size - out.file_offset % block_size);
+                }
+                int buffer = shard.ring ? shard.ring->acquire_buffer() : -1;
+                if (buffer >= 0)
+                {
+                    uint64_t op = ++shard.next_ring_op;
+                    if (!shard.ring->prep_read_fixed(out.file->fd, buffer, span, out.file_offset, op))
+                    {
+                        shard.ring->release_buffer(buffer);
+                        return false;
+                    }
+                    shard.ring_ops[op] = {conn.fd, buffer, false};
+                    conn.ring_op = op;
+                    conn.ring_buffer = buffer;
+                    return true;
+                }
+                long target = out.file_remaining - span;
+                if (!flush_file_range(conn, out, span))
+                    return false;
+                if (out.file_remaining > target)
+                    return true;
+                continue;
             }
-            closedir(dir);
-            if (file_path.empty())
+        }
+        conn.out_queue.pop_front();
+    }
+    return true;
+}
+
+// Sends up to length bytes of the range; stops early when the socket is full.
+bool Server::flush_file_range(Connection &conn, OutgoingData &out, long length)
+{
+    long target = out.file_remaining - length;
+    while (out.file_remaining > target)
+    {
+        ssize_t sent = sendfile(conn.fd, out.file->fd, &out.file_offset, out.file_remaining - target);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINVAL || errno == ENOSYS)
             {
-                std::cerr << "File not found in directory\n";
-                break;
+                out.buffered = true;
+                return flush_file_range_buffered(conn, out, target);
+            }
+            perror("Error sending file chunk");
+            return false;
+        }
+        if (sent == 0)
+        {
+            out.file_remaining = 0;
+            break;
+        }
+        out.file_remaining -= sent;
+    }
+    return true;
+}
+
+// For files sendfile cannot read from: pread into the item's buffer and send
+// from there until file_remaining reaches target. Bytes count as sent only
+// once the socket takes them, so a full socket leaves the rest of the buffer
+// for the next flush.
+bool Server::flush_file_range_buffered(Connection &conn, OutgoingData &out, long target)
+{
+    while (out.file_remaining > target)
+    {
+        if (out.buffer_offset == out.buffer.size())
+        {
+            out.buffer.resize(std::min<long>(64 * 1024, out.file_remaining - target));
+            ssize_t n = pread(out.file->fd, &out.buffer[0], out.buffer.size(), out.file_offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                perror("Error reading file chunk");
+                return false;
             }
-            FILE *file = fopen(file_path.c_str(), "rb");
-            if (!file)
+            out.buffer.resize(n);
+            out.buffer_offset = 0;
+            if (n == 0)
             {
-                std::cerr << "Failed to open file\n";
+                out.file_remaining = 0;
                 break;
             }
-            fseek(file, start_byte, SEEK_SET);
-            char buffer_file[32];
-            long bytes_left = chunk_size;
-            while (bytes_left > 0)
+        }
+        ssize_t sent = send(conn.fd, &out.buffer[out.buffer_offset], out.buffer.size() - out.buffer_offset, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            return false;
+        }
+        out.buffer_offset += sent;
+        out.file_offset += sent;
+        out.file_remaining -= sent;
+    }
+    return true;
+}
+
+// Sends the part of the front range held by the chunk cache's block at the
+// current offset. The block is looked up at send time and released before
+// returning, so queued requests pin nothing and a miss never reads on the
+// loop.
+CachedSendResult Server::flush_cached_block(Connection &conn, OutgoingData &out)
+{
+    std::shared_ptr<ChunkBlock> block = chunk_cache.lookup(out.file->file_id, out.file->fd, out.file_offset, out.file->size, out.file);
+    if (!block || out.file_offset - block->offset >= block->length)
+        return CACHED_MISS;
+    size_t begin = out.file_offset - block->offset;
+    size_t length = std::min<long>(block->length - begin, out.file_remaining);
+    bool more = (long)length < out.file_remaining || conn.out_queue.size() > 1;
+    while (1)
+    {
+        ssize_t sent = send(conn.fd, block->data + begin, length, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CACHED_BLOCKED;
+            return CACHED_FAILED;
+        }
+        out.file_offset += sent;
+        out.file_remaining -= sent;
+        return CACHED_SENT;
+    }
+}
+
+void Server::setup_ring(Shard &shard)
+{
+    shard.ring.reset();
+    shard.next_ring_op = 0;
+    if (io_backend != IO_BACKEND_URING)
+        return;
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if (!ring->init(256, 64, 64 * 1024))
+    {
+        std::cerr << "io_uring unavailable, falling back to sendfile\n";
+        return;
+    }
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = ring->get_event_fd();
+    if (epoll_ctl(shard.epoll_fd, EPOLL_CTL_ADD, ring->get_event_fd(), &ev) < 0)
+    {
+        perror("epoll_ctl failed");
+        return;
+    }
+    shard.ring = std::move(ring);
+}
+
+bool Server::submit_ring_send(Shard &shard, Connection &conn)
+{
+    uint64_t op = ++shard.next_ring_op;
+    const char *data = shard.ring->get_buffer(conn.ring_buffer) + conn.ring_sent;
+    if (!shard.ring->prep_send(conn.fd, data, conn.ring_length - conn.ring_sent, op))
+        return false;
+    shard.ring_ops[op] = {conn.fd, conn.ring_buffer, true};
+    conn.ring_op = op;
+    return true;
+}
+
+void Server::handle_ring_completions(Shard &shard)
+{
+    for (const IoUringCompletion &completion : shard.ring->reap())
+    {
+        auto op_it = shard.ring_ops.find(completion.user_data);
+        if (op_it == shard.ring_ops.end())
+            continue;
+        RingOp op = op_it->second;
+        shard.ring_ops.erase(op_it);
+        auto it = shard.connections.find(op.fd);
+        if (it == shard.connections.end() || it->second.ring_op != completion.user_data)
+        {
+            shard.ring->release_buffer(op.buffer);
+            continue;
+        }
+        Connection &conn = it->second;
+        OutgoingData &out = conn.out_queue.front();
+        conn.ring_op = 0;
+        bool keep_open = true;
+        if (!op.is_send)
+        {
+            if (completion.result <= 0)
             {
-                size_t to_read = std::min(32L, bytes_left);
-                size_t bytes_read = fread(buffer_file, 1, to_read, file);
-                if (bytes_read == 0)
-                    break;
-                if (send(client_fd, buffer_file, bytes_read, 0) == -1)
-                {
-                    perror("Error sending file chunk");
-                    break;
-                }
-                bytes_left -= bytes_read;
+                keep_open = false;
+            }
+            else
+            {
+                conn.ring_length = completion.result;
+                conn.ring_sent = 0;
+                out.file_offset += completion.result;
+                out.file_remaining -= completion.result;
+                keep_open = submit_ring_send(shard, conn);
             }
-            fclose(file);
         }
+        else if (completion.result == -EAGAIN)
+        {
+            keep_open = true;
+        }
+        else if (completion.result < 0)
+        {
+            keep_open = false;
+        }
+        else
+        {
+            conn.ring_sent += completion.result;
+            if (conn.ring_sent < conn.ring_length)
+            {
+                keep_open = submit_ring_send(shard, conn);
+            }
+            else
+            {
+                shard.ring->release_buffer(conn.ring_buffer);
+                conn.ring_buffer = -1;
+                keep_open = flush_connection(shard, conn);
+            }
+        }
+        if (!keep_open)
+        {
+            close_connection(shard, op.fd);
+            continue;
+        }
+        update_write_interest(shard, conn);
     }
+}
 
-    close(client_fd);
-    return nullptr;
+void Server::update_write_interest(Shard &shard, Connection &conn)
+{
+    bool want_write = !conn.out_queue.empty() && conn.ring_op == 0;
+    if (want_write == conn.want_write)
+        return;
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    if (want_write)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = conn.fd;
+    epoll_ctl(shard.epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+    conn.want_write = want_write;
+}
+
+void Server::close_connection(Shard &shard, int fd)
+{
+    auto it = shard.connections.find(fd);
+    if (it == shard.connections.end())
+        return;
+    if (shard.ring && it->second.ring_buffer >= 0 && it->second.ring_op == 0)
+        shard.ring->release_buffer(it->second.ring_buffer);
+    // A send still sitting in the submission queue would otherwise look the
+    // fd up after close() and could hit the next connection to reuse it.
+    // Submitting it now pins the socket, and the cancel queued behind it
+    // stops a send left waiting on a peer that is gone. Its completion finds
+    // no connection and only returns the buffer. A full submission queue is
+    // drained once before the cancel is given up on.
+    if (shard.ring && it->second.ring_op != 0)
+    {
+        if (!shard.ring->prep_cancel(it->second.ring_op, 0))
+        {
+            shard.ring->submit();
+            if (!shard.ring->prep_cancel(it->second.ring_op, 0))
+                std::cerr << "io_uring queue full, send on fd " << fd << " left uncancelled\n";
+        }
+        shard.ring->submit();
+    }
+    epoll_ctl(shard.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    shard.connections.erase(it);
 }
 
 std::map<int, FileInfo> Server::list_files()
@@ -174,76 +715,303 @@ std::map<int, FileInfo> Server::list_files()
     while ((entry = readdir(dir)) != NULL)
     {
         std::string name = entry->d_name;
-        if (name == "." || name == "..")
+        if (entry->d_type != DT_DIR || name.empty() || name.find_first_not_of("0123456789") != std::string::npos)
             continue;
-        std::string full_path = directory_path + "/" + name;
-        if (entry->d_type == DT_DIR)
+        int key = std::stoi(name);
+        FileInfo info;
+        if (scan_file_dir(key, info))
+            map_files[key] = info;
+    }
+    closedir(dir);
+    return map_files;
+}
+
+bool Server::scan_file_dir(int file_id, FileInfo &info)
+{
+    std::string full_path = directory_path + "/" + std::to_string(file_id);
+    DIR *subdir = opendir(full_path.c_str());
+    if (subdir == NULL)
+        return false;
+    bool found = false;
+    struct dirent *subentry;
+    while ((subentry = readdir(subdir)) != NULL)
+    {
+        std::string file = subentry->d_name;
+        if (file == "." || file == "..")
+            continue;
+        if (is_journal_path(file))
+            continue;
+        if (subentry->d_type == DT_REG)
         {
-            DIR *subdir = opendir(full_path.c_str());
-            if (subdir == NULL)
+            std::string file_path = full_path + "/" + file;
+            struct stat file_stat;
+            long file_size = 0;
+            uint64_t journal_size;
+            if (DownloadJournal::read_total_size(file_path, journal_size))
             {
-                perror("Error opening directory");
-                exit(EXIT_FAILURE);
+                file_size = journal_size;
             }
-            struct dirent *subentry;
-            while ((subentry = readdir(subdir)) != NULL)
+            else if (stat(file_path.c_str(), &file_stat) == 0)
             {
-                std::string file = subentry->d_name;
-                if (file == "." || file == "..")
-                    continue;
-                if (subentry->d_type == DT_REG)
-                {
-                    int key = std::stoi(name);
-                    std::string file_path = full_path + "/" + file;
-                    struct stat file_stat;
-                    long file_size = 0;
-                    if (stat(file_path.c_str(), &file_stat) == 0)
-                    {
-                        file_size = file_stat.st_size;
-                    }
-                    map_files[key] = {file, file_size};
-                }
+                file_size = file_stat.st_size;
             }
-            closedir(subdir);
+            info = {file, file_size};
+            found = true;
         }
     }
-    closedir(dir);
-    return map_files;
+    closedir(subdir);
+    return found;
 }
 
-bool Server::bind_available()
+void Server::build_catalog()
 {
-    int opt = 1;
-    struct sockaddr_in addr{};
-    for (int i = 0; i < ports.size(); ++i)
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd >= 0)
+    {
+        root_watch = inotify_add_watch(inotify_fd, directory_path.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+        if (root_watch < 0)
+            perror("inotify_add_watch failed");
+    }
+    else
     {
-        int fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd == -1)
+        perror("inotify_init1 failed");
+    }
+    std::map<int, FileInfo> files = list_files();
+    for (const auto &entry : files)
+    {
+        watch_file_dir(entry.first);
+    }
+    {
+        std::lock_guard<std::mutex> lock(catalog_mutex);
+        catalog = files;
+    }
+    publish_catalog();
+    if (inotify_fd >= 0)
+    {
+        pthread_t watch_thread_id;
+        pthread_create(&watch_thread_id, nullptr, catalog_watch_thread_helper, this);
+        pthread_detach(watch_thread_id);
+    }
+}
+
+void Server::publish_catalog()
+{
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    catalog_response = std::make_shared<const std::string>(encode_catalog(catalog));
+}
+
+std::shared_ptr<const std::string> Server::get_catalog_response()
+{
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    return catalog_response;
+}
+
+// Complete files answer without locking. For a file still being
+// downloaded, one caller at a time re-reads the journal, outside the lock,
+// once the snapshot is AVAILABILITY_TTL_SECONDS old; the others keep using
+// the previous one. Pieces only ever become available, so a stale snapshot
+// can understate what is held but never overstate it. Returns null when the
+// journal cannot be read.
+std::shared_ptr<const PieceAvailability> Server::get_availability(CachedFile &file)
+{
+    static const std::shared_ptr<const PieceAvailability> whole = std::make_shared<const PieceAvailability>(PieceAvailability{true, 0, {}, 0});
+    if (!file.partial)
+        return whole;
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(file.availability_mutex);
+        if (file.availability_loaded &&
+            (file.availability_refreshing ||
+             std::chrono::duration<double>(now - file.availability_loaded_at).count() < AVAILABILITY_TTL_SECONDS))
+            return file.availability;
+        file.availability_refreshing = true;
+    }
+    std::shared_ptr<PieceAvailability> pieces = std::make_shared<PieceAvailability>();
+    if (!DownloadJournal::read_availability(file.path, *pieces))
+        pieces = nullptr;
+    std::lock_guard<std::mutex> lock(file.availability_mutex);
+    file.availability = pieces;
+    file.availability_loaded_at = now;
+    file.availability_loaded = true;
+    file.availability_refreshing = false;
+    return pieces;
+}
+
+void Server::watch_file_dir(int file_id)
+{
+    if (inotify_fd < 0)
+        return;
+    std::string full_path = directory_path + "/" + std::to_string(file_id);
+    // Content changes are picked up once the writer closes the file, not on
+    // every write; a file still being downloaded is sized from its journal.
+    int wd = inotify_add_watch(inotify_fd, full_path.c_str(), IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd >= 0)
+        dir_watches[wd] = file_id;
+}
+
+void Server::refresh_catalog_entry(int file_id)
+{
+    file_cache.invalidate(file_id);
+    chunk_cache.invalidate(file_id);
+    FileInfo info;
+    bool found = scan_file_dir(file_id, info);
+    std::lock_guard<std::mutex> lock(catalog_mutex);
+    if (found)
+        catalog[file_id] = info;
+    else
+        catalog.erase(file_id);
+}
+
+void *Server::catalog_watch_thread_helper(void *arg)
+{
+    return static_cast<Server *>(arg)->catalog_watch_thread();
+}
+
+void *Server::catalog_watch_thread()
+{
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    while (1)
+    {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len < 0)
         {
-            perror("Socket creation failed");
-            exit(EXIT_FAILURE);
+            if (errno == EINTR)
+                continue;
+            perror("inotify read failed");
+            break;
         }
-        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+        std::set<int> dirty;
+        bool rescan = false;
+        for (char *ptr = buffer; ptr < buffer + len;)
         {
-            perror("setsockopt failed");
-            exit(EXIT_FAILURE);
+            struct inotify_event *event = reinterpret_cast<struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                rescan = true;
+                continue;
+            }
+            if (event->wd == root_watch)
+            {
+                std::string name = event->len > 0 ? event->name : "";
+                if (!(event->mask & IN_ISDIR) || name.empty() || name.find_first_not_of("0123456789") != std::string::npos)
+                    continue;
+                int file_id = std::stoi(name);
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    watch_file_dir(file_id);
+                dirty.insert(file_id);
+                continue;
+            }
+            auto it = dir_watches.find(event->wd);
+            if (it == dir_watches.end())
+                continue;
+            if (event->mask & IN_IGNORED)
+            {
+                dirty.insert(it->second);
+                dir_watches.erase(it);
+                continue;
+            }
+            dirty.insert(it->second);
         }
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        addr.sin_port = htons(ports[i]);
-        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        if (rescan)
         {
-            listen_fd = fd;
-            listen_port = ports[i];
-            if (listen(listen_fd, 4) < 0)
+            file_cache.clear();
+            chunk_cache.clear();
+            std::map<int, FileInfo> files = list_files();
+            for (const auto &entry : files)
             {
-                perror("Listen failed");
-                close(listen_fd);
-                exit(EXIT_FAILURE);
+                watch_file_dir(entry.first);
+            }
+            std::lock_guard<std::mutex> lock(catalog_mutex);
+            catalog = files;
+        }
+        else
+        {
+            for (int file_id : dirty)
+            {
+                refresh_catalog_entry(file_id);
             }
-            return true;
         }
+        if (rescan || !dirty.empty())
+            publish_catalog();
+    }
+    return nullptr;
+}
+
+int Server::open_listener(int port, bool reuse_port)
+{
+    int opt = 1;
+    struct sockaddr_in addr{};
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    {
+        perror("setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        perror("setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0)
+    {
+        perror("Listen failed");
         close(fd);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+bool Server::bind_available()
+{
+    bool reuse_port = num_shards > 1;
+    for (size_t i = 0; i < ports.size(); ++i)
+    {
+        // Another seeder could join an SO_REUSEPORT group on a port we hold, so
+        // probe with a plain socket first: it only binds if the port is free.
+        if (reuse_port)
+        {
+            int probe_fd = open_listener(ports[i], false);
+            if (probe_fd < 0)
+                continue;
+            close(probe_fd);
+        }
+        std::vector<int> listen_fds;
+        for (int j = 0; j < num_shards; j++)
+        {
+            int fd = open_listener(ports[i], reuse_port);
+            if (fd < 0)
+                break;
+            listen_fds.push_back(fd);
+        }
+        if ((int)listen_fds.size() != num_shards)
+        {
+            for (int fd : listen_fds)
+                close(fd);
+            continue;
+        }
+        listen_port = ports[i];
+        shards.resize(num_shards);
+        for (int j = 0; j < num_shards; j++)
+        {
+            shards[j].index = j;
+            shards[j].listen_fd = listen_fds[j];
+            shards[j].epoll_fd = -1;
+        }
+        return true;
     }
     return false;
-}
\ No newline at end of file
+}
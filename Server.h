@@ -18,17 +18,98 @@
 #include <sys/stat.h>
 #include <limits>
 #include <iomanip>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <deque>
+#include <sched.h>
+#include <memory>
+#include <set>
+#include <sys/inotify.h>
+#include <chrono>
+#include "IoUring.h"
+#include "FileCache.h"
+#include "ChunkCache.h"
+#include "Protocol.h"
+#include "DownloadJournal.h"
 
-struct FileInfo
+const double AVAILABILITY_TTL_SECONDS = 0.5;
+
+enum CachedSendResult
+{
+    CACHED_SENT,
+    CACHED_BLOCKED,
+    CACHED_MISS,
+    CACHED_FAILED
+};
+
+struct OutgoingData
+{
+    std::string buffer;
+    size_t buffer_offset = 0;
+    std::shared_ptr<CachedFile> file = nullptr;
+    off_t file_offset = 0;
+    long file_remaining = 0;
+    bool cacheable = false;
+    bool is_range = false;
+    uint32_t request_id = 0;
+    uint64_t range_offset = 0;
+    // Set once sendfile is refused for the file; the range is then sent
+    // from buffer, refilled with pread, and buffer_offset marks the unsent
+    // part of it.
+    bool buffered = false;
+};
+
+struct Connection
+{
+    int fd;
+    uint16_t version;
+    uint64_t max_chunk_size;
+    FrameDecoder decoder;
+    std::deque<OutgoingData> out_queue;
+    bool want_write;
+    uint64_t ring_op;
+    int ring_buffer;
+    long ring_length;
+    long ring_sent;
+};
+
+struct RingOp
 {
-    std::string filename;
-    long size;
+    int fd;
+    int buffer;
+    bool is_send;
+};
+
+struct Shard
+{
+    int index;
+    int cpu;
+    int listen_fd;
+    int epoll_fd;
+    std::map<int, Connection> connections;
+    std::unique_ptr<IoUring> ring;
+    uint64_t next_ring_op;
+    std::map<uint64_t, RingOp> ring_ops;
+};
+
+enum IoBackend
+{
+    IO_BACKEND_SENDFILE,
+    IO_BACKEND_URING
 };
 
 class Server
 {
 public:
-    Server(const std::string &dir, const std::vector<int> &ports);
+    Server(const std::string &dir, const std::vector<int> &ports, int backlog = SOMAXCONN, int num_shards = 1);
+    void set_io_backend(IoBackend backend);
+    void set_chunk_cache(size_t budget_bytes, bool huge_pages);
+    void set_upload_capacity(uint64_t bytes_per_second);
+    ChunkCacheStats get_chunk_cache_stats();
     void start();
     int get_listen_port() const;
     const std::vector<int> &get_ports() const;
@@ -37,18 +118,56 @@ public:
 private:
     std::string directory_path;
     std::vector<int> ports;
-    int listen_fd;
     int listen_port;
-    static void *accept_thread_helper(void *arg);
-    void *accept_thread();
-    struct AcceptArgs
+    int backlog;
+    int num_shards;
+    IoBackend io_backend;
+    std::vector<Shard> shards;
+    std::mutex catalog_mutex;
+    std::map<int, FileInfo> catalog;
+    std::shared_ptr<const std::string> catalog_response;
+    int inotify_fd;
+    int root_watch;
+    std::map<int, int> dir_watches;
+    FileCache file_cache;
+    ChunkCache chunk_cache;
+    size_t chunk_cache_budget;
+    bool chunk_cache_huge_pages;
+    uint64_t upload_capacity;
+    struct ShardArgs
     {
-        int *fd_ptr;
+        Shard *shard_ptr;
         Server *server_ptr;
     };
-    static void *handle_client_thread_helper(void *arg);
-    void *handle_client_thread(int *client_fd_ptr);
+    static void *event_loop_thread_helper(void *arg);
+    void *event_loop_thread(Shard *shard);
+    void accept_connections(Shard &shard);
+    bool handle_readable(Connection &conn);
+    bool handle_request(Connection &conn, const Frame &frame);
+    void queue_frame(Connection &conn, const FrameHeader &header, const std::string &payload = std::string());
+    void queue_file_range(Connection &conn, uint32_t request_id, const std::shared_ptr<CachedFile> &file,
+                          const std::shared_ptr<const PieceAvailability> &pieces, off_t start_byte, long chunk_size);
+    CachedSendResult flush_cached_block(Connection &conn, OutgoingData &out);
+    void cancel_range(Connection &conn, uint32_t request_id, uint64_t range_offset);
+    bool flush_connection(Shard &shard, Connection &conn);
+    bool flush_file_range(Connection &conn, OutgoingData &out, long length);
+    bool flush_file_range_buffered(Connection &conn, OutgoingData &out, long target);
+    void setup_ring(Shard &shard);
+    bool submit_ring_send(Shard &shard, Connection &conn);
+    void handle_ring_completions(Shard &shard);
+    void update_write_interest(Shard &shard, Connection &conn);
+    void close_connection(Shard &shard, int fd);
     std::map<int, FileInfo> list_files();
+    bool scan_file_dir(int file_id, FileInfo &info);
+    void build_catalog();
+    void publish_catalog();
+    std::shared_ptr<const std::string> get_catalog_response();
+    std::shared_ptr<const PieceAvailability> get_availability(CachedFile &file);
+    void watch_file_dir(int file_id);
+    void refresh_catalog_entry(int file_id);
+    static void *catalog_watch_thread_helper(void *arg);
+    void *catalog_watch_thread();
+    int open_listener(int port, bool reuse_port);
     bool bind_available();
 };
 
@@ -0,0 +1,64 @@
+#include "SyncThread.h"
+
+SyncThread::SyncThread()
+{
+    stopping = false;
+    joined = false;
+    pthread_create(&sync_thread_id, nullptr, sync_thread_helper, this);
+}
+
+SyncThread::~SyncThread()
+{
+    stop();
+}
+
+void SyncThread::post(const void *key, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(sync_mutex);
+        if (stopping || !queued_keys.insert(key).second)
+            return;
+        tasks.emplace_back(key, std::move(task));
+    }
+    work_available.notify_one();
+}
+
+// Runs whatever is still queued, so the last journal flush and scoreboard
+// save of the session reach the disk, then joins the thread.
+void SyncThread::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sync_mutex);
+        if (joined)
+            return;
+        stopping = true;
+        joined = true;
+    }
+    work_available.notify_one();
+    pthread_join(sync_thread_id, nullptr);
+}
+
+void *SyncThread::sync_thread_helper(void *arg)
+{
+    return static_cast<SyncThread *>(arg)->sync_thread();
+}
+
+void *SyncThread::sync_thread()
+{
+    std::unique_lock<std::mutex> lock(sync_mutex);
+    while (1)
+    {
+        work_available.wait(lock, [&]
+                            { return stopping || !tasks.empty(); });
+        if (tasks.empty())
+            break;
+        std::function<void()> task = std::move(tasks.front().second);
+        queued_keys.erase(tasks.front().first);
+        tasks.pop_front();
+        lock.unlock();
+        task();
+        task = nullptr;
+        lock.lock();
+    }
+    return nullptr;
+}
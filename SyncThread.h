@@ -0,0 +1,36 @@
+#ifndef SYNC_THREAD_H
+#define SYNC_THREAD_H
+
+#include <set>
+#include <deque>
+#include <utility>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+
+// Runs the blocking disk work of a download (journal fdatasyncs, mapping
+// writeback, scoreboard saves) off the event loop. Tasks are keyed by the
+// object they flush; posting while a task for that key is still queued is a
+// no-op, so a burst of requests costs one flush.
+class SyncThread
+{
+public:
+    SyncThread();
+    ~SyncThread();
+    void post(const void *key, std::function<void()> task);
+    void stop();
+
+private:
+    std::deque<std::pair<const void *, std::function<void()>>> tasks;
+    std::set<const void *> queued_keys;
+    std::mutex sync_mutex;
+    std::condition_variable work_available;
+    bool stopping;
+    bool joined;
+    pthread_t sync_thread_id;
+    static void *sync_thread_helper(void *arg);
+    void *sync_thread();
+};
+
+#endif